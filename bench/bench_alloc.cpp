@@ -0,0 +1,86 @@
+// Allocator benchmark: a churning script on the system allocator against the pooled one,
+// and the slowest collection step while big tables die, with frees inline or deferred.
+// build together with tlua.cpp and lua.cpp (and luasocket.cpp unless TLUA_NO_SOCKET).
+//
+#include "../tlua.h"
+#include <chrono>
+#include <stdio.h>
+
+// counts the requests that reach malloc/realloc with the system allocator.
+struct Counter
+{
+    lua_Alloc alloc;
+    void* ud;
+    uint64_t calls = 0;
+
+    static void* allocf(void* ud, void* ptr, size_t osize, size_t nsize)
+    {
+        auto& c = *(Counter*)ud;
+        if (nsize) c.calls++;
+        return c.alloc(c.ud, ptr, osize, nsize);
+    }
+};
+
+// short strings, small tables and closures, most of them garbage soon, some kept a while.
+static const char* script = R"(
+    local keep, n = {}, 0
+    for i = 1, 400000 do
+        local t = { i, tostring(i), x = i * 2, f = function() return i end }
+        if i % 5 == 0 then
+            n = n % 4096 + 1
+            keep[n] = t
+        end
+    end
+)";
+
+int main()
+{
+    using namespace std::chrono;
+
+    const int rounds = 5;
+    printf("%8s %10s %14s %12s %8s\n", "alloc", "ms/run", "system allocs", "peak KB", "slabs");
+    for (auto allocator : { tlua::LuaMgr::AllocSystem, tlua::LuaMgr::AllocPool }) {
+        tlua::LuaMgr lua(tlua::LuaMgr::LibAll, 0, allocator);
+        Counter counter;
+        auto L = tlua::LuaObj::L;
+        if (allocator == tlua::LuaMgr::AllocSystem) {
+            counter.alloc = lua_getallocf(L, &counter.ud);
+            lua_setallocf(L, Counter::allocf, &counter);
+        }
+        auto start = steady_clock::now();
+        for (int i = 0; i < rounds; i++)
+            lua.doString(script);
+        auto ms = duration_cast<microseconds>(steady_clock::now() - start).count() / 1000.0 / rounds;
+        auto pool = lua.poolStats();
+        auto calls = allocator == tlua::LuaMgr::AllocSystem ? counter.calls : pool.slabsMapped + pool.largeAllocs;
+        printf("%8s %10.1f %14llu %12zu %8zu\n", allocator == tlua::LuaMgr::AllocSystem ? "system" : "pool",
+            ms, (unsigned long long)calls, lua.memoryUsage().peak / 1024, pool.slabs);
+        if (allocator == tlua::LuaMgr::AllocSystem)
+            lua_setallocf(L, counter.alloc, counter.ud);
+    }
+
+    printf("\n%8s %14s %14s %10s\n", "frees", "worst step us", "total ms", "deferred");
+    for (bool deferred : { false, true }) {
+        tlua::LuaMgr lua;
+        auto L = tlua::LuaObj::L;
+        if (deferred) lua.setDeferredFree(64 * 1024);
+        int64_t worst = 0, total = 0;
+        for (int i = 0; i < rounds; i++) {
+            lua.doString("big = {} for i = 1, 64 do local t = {} for j = 1, 50000 do t[j] = j end big[i] = t end");
+            lua_gc(L, LUA_GCCOLLECT, 0);
+            lua.doString("big = nil");
+            lua_gc(L, LUA_GCSTOP, 0);
+            for (bool done = false; !done;) {
+                auto start = steady_clock::now();
+                done = lua_gc(L, LUA_GCSTEP, 0) != 0;
+                auto us = duration_cast<microseconds>(steady_clock::now() - start).count();
+                worst = std::max<int64_t>(worst, us);
+                total += us;
+            }
+            lua_gc(L, LUA_GCRESTART, 0);
+        }
+        printf("%8s %14lld %14.1f %10llu\n", deferred ? "deferred" : "inline", (long long)worst, total / 1000.0,
+            (unsigned long long)lua.deferredFreeStats().deferred);
+    }
+    return 0;
+}
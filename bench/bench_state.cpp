@@ -0,0 +1,66 @@
+// State creation benchmark: LuaMgr construction time against registered type count.
+// build together with tlua.cpp and lua.cpp (and luasocket.cpp unless TLUA_NO_SOCKET).
+//
+#include "../tlua.h"
+#include <chrono>
+#include <stdio.h>
+
+template<int I>
+struct BenchType
+{
+    int value = I;
+    int get() { return value; }
+    void set(int v) { value = v; }
+
+    static const char* name()
+    {
+        static std::string s = "Bench" + std::to_string(I);
+        return s.c_str();
+    }
+};
+
+// same expansion as TLuaType, which needs a plain identifier for the type.
+template<int I>
+void registerBenchType()
+{
+    using Class = BenchType<I>;
+    static constexpr tlua::TypeReg regs[] = {
+        TLuaConstructor()
+        TLuaFieldAddr(get)
+        TLuaFieldAddr(set)
+        TLuaFuncOverload(add, (Class* c, int a), c->value + a)
+        TLuaFuncOverload(add, (Class* c, int a, int b), c->value + a + b)
+        { nullptr }
+    };
+    tlua::LuaMgr::get()->newType<Class>(Class::name(), regs);
+}
+
+template<size_t... I>
+void addBenchTypes(std::index_sequence<I...>)
+{
+    auto& regs = tlua::LuaMgr::getRegisters();
+    std::initializer_list<int> ordered = { (regs.push_back({ BenchType<I>::name(), &registerBenchType<I> }), 0)... };
+}
+
+int main()
+{
+    using namespace std::chrono;
+
+    auto& regs = tlua::LuaMgr::getRegisters();
+    auto userTypes = regs.size();
+    addBenchTypes(std::make_index_sequence<256>());
+    auto all = regs;
+
+    const int rounds = 50;
+    printf("%8s %14s\n", "types", "us/state");
+    for (size_t n : { 0, 16, 64, 256 }) {
+        regs.assign(all.begin(), all.begin() + userTypes + n);
+        auto start = steady_clock::now();
+        for (int i = 0; i < rounds; i++) {
+            tlua::LuaMgr lua;
+        }
+        auto us = duration_cast<microseconds>(steady_clock::now() - start).count() / (double)rounds;
+        printf("%8zu %14.1f\n", n, us);
+    }
+    return 0;
+}
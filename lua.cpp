@@ -1084,6 +1084,11 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
       res = g->gcrunning;
       break;
     }
+    case LUA_GCSTATS: {
+      res = cast_int(g->gcstats.cycles);
+      if (data) memset(&g->gcstats, 0, sizeof(g->gcstats));
+      break;
+    }
     default: res = -1;  /* invalid option */
   }
   lua_unlock(L);
@@ -1091,6 +1096,89 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
 }
 
 
+LUA_API void lua_getgcstats (lua_State *L, lua_GCStats *stats) {
+  lua_lock(L);
+  *stats = G(L)->gcstats;
+  lua_unlock(L);
+}
+
+
+/*
+** line counts. functions already running keep their previous setting
+** until their frame is entered again (a call or a return into it).
+*/
+LUA_API int lua_linecount (lua_State *L, int what) {
+  global_State *g = G(L);
+  GCObject *o;
+  int res;
+  lua_lock(L);
+  res = g->linecount;
+  switch (what) {
+    case LUA_LINECOUNTSTOP: g->linecount = 0; break;
+    case LUA_LINECOUNTSTART: g->linecount = 1; break;
+    case LUA_LINECOUNTRESET: {  /* counters stay allocated, running frames use them */
+      for (o = g->allgc; o != NULL; o = o->next) {
+        Proto *p = (o->tt == LUA_TPROTO) ? gco2p(o) : NULL;
+        if (p && p->hits)
+          memset(p->hits, 0, p->sizecode * sizeof(lua_Unsigned));
+      }
+      break;
+    }
+    case LUA_LINECOUNTISRUNNING: break;
+    default: res = -1;  /* invalid option */
+  }
+  lua_unlock(L);
+  return res;
+}
+
+
+#if defined(TLUA_OPCODE_STATS)
+static_assert(LUA_NUMOPCODES == NUM_OPCODES, "LUA_NUMOPCODES out of date");
+
+LUA_API void lua_getopstats (lua_State *L, lua_Unsigned *counts,
+                             lua_Unsigned *pairs, int reset) {
+  global_State *g = G(L);
+  lua_lock(L);
+  if (counts) memcpy(counts, g->opcounts, sizeof(g->opcounts));
+  if (pairs) memcpy(pairs, g->oppairs, sizeof(g->oppairs));
+  if (reset) {
+    memset(g->opcounts, 0, sizeof(g->opcounts));
+    memset(g->oppairs, 0, sizeof(g->oppairs));
+  }
+  lua_unlock(L);
+}
+
+
+LUA_API const char *lua_opname (int op) {
+  return (op >= 0 && op < NUM_OPCODES) ? luaP_opnames[op] : NULL;
+}
+#endif
+
+
+LUA_API void lua_getlinecounts (lua_State *L, lua_LineCount f, void *ud) {
+  GCObject *o;
+  lua_lock(L);
+  for (o = G(L)->allgc; o != NULL; o = o->next) {
+    Proto *p = (o->tt == LUA_TPROTO) ? gco2p(o) : NULL;
+    int pc, line = -1;
+    lua_Unsigned count = 0;
+    if (p == NULL || p->source == NULL || p->lineinfo == NULL)
+      continue;  /* not a function or no line information */
+    for (pc = 0; pc < p->sizecode; pc++) {  /* one call per run of a line */
+      lua_Unsigned n = p->hits ? p->hits[pc] : 0;
+      if (p->lineinfo[pc] != line) {
+        if (line >= 0) f(ud, getstr(p->source), line, count);
+        line = p->lineinfo[pc];
+        count = 0;
+      }
+      if (n > count) count = n;
+    }
+    if (line >= 0) f(ud, getstr(p->source), line, count);
+  }
+  lua_unlock(L);
+}
+
+
 
 /*
 ** miscellaneous functions
@@ -2485,17 +2573,44 @@ static int luaB_rawset (lua_State *L) {
 }
 
 
+static void pushgcstats (lua_State *L) {
+  lua_GCStats s;
+  int i;
+  lua_getgcstats(L, &s);
+  lua_createtable(L, 0, 13);
+#define setgcfield(f)	(lua_pushinteger(L, s.f), lua_setfield(L, -2, #f))
+  setgcfield(cycles); setgcfield(steps); setgcfield(fullgcs);
+  setgcfield(totaltime); setgcfield(maxpause);
+  setgcfield(lastcycletime); setgcfield(maxcycletime);
+  setgcfield(lastatomic); setgcfield(maxatomic);
+  setgcfield(lastmarked); setgcfield(lastswept); setgcfield(lastfreed);
+#undef setgcfield
+  lua_createtable(L, LUA_GCSTATS_BUCKETS, 0);
+  for (i = 0; i < LUA_GCSTATS_BUCKETS; i++) {
+    lua_pushinteger(L, s.pauses[i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_setfield(L, -2, "pauses");
+}
+
+
 static int luaB_collectgarbage (lua_State *L) {
   static const char *const opts[] = {"stop", "restart", "collect",
     "count", "step", "setpause", "setstepmul",
-    "isrunning", NULL};
+    "isrunning", "stats", NULL};
   static const int optsnum[] = {LUA_GCSTOP, LUA_GCRESTART, LUA_GCCOLLECT,
     LUA_GCCOUNT, LUA_GCSTEP, LUA_GCSETPAUSE, LUA_GCSETSTEPMUL,
-    LUA_GCISRUNNING};
+    LUA_GCISRUNNING, LUA_GCSTATS};
   int o = optsnum[luaL_checkoption(L, 1, "collect", opts)];
   int ex = (int)luaL_optinteger(L, 2, 0);
-  int res = lua_gc(L, o, ex);
+  int res;
+  if (o == LUA_GCSTATS)  /* read before a reset */
+    pushgcstats(L);
+  res = lua_gc(L, o, ex);
   switch (o) {
+    case LUA_GCSTATS: {
+      return 1;
+    }
     case LUA_GCCOUNT: {
       int b = lua_gc(L, LUA_GCCOUNTB, 0);
       lua_pushnumber(L, (lua_Number)res + ((lua_Number)b/1024));
@@ -4994,6 +5109,16 @@ LUA_API int lua_gethookcount (lua_State *L) {
 }
 
 
+LUA_API void lua_setthreadhook (lua_State *L, lua_ThreadHook func) {
+  G(L)->threadhook = func;
+}
+
+
+LUA_API lua_ThreadHook lua_getthreadhook (lua_State *L) {
+  return G(L)->threadhook;
+}
+
+
 LUA_API int lua_getstack (lua_State *L, int level, lua_Debug *ar) {
   int status;
   CallInfo *ci;
@@ -6206,6 +6331,8 @@ LUA_API int lua_resume (lua_State *L, lua_State *from, int nargs) {
   unsigned short oldnny = L->nny;  /* save "number of non-yieldable" calls */
   lua_lock(L);
   luai_userstateresume(L, nargs);
+  if (G(L)->threadhook)
+    G(L)->threadhook(L, from, LUA_THREADRESUME);
   L->nCcalls = (from) ? from->nCcalls + 1 : 1;
   L->nny = 0;  /* allow yields */
   api_checknelems(L, (L->status == LUA_OK) ? nargs + 1 : nargs);
@@ -6227,6 +6354,8 @@ LUA_API int lua_resume (lua_State *L, lua_State *from, int nargs) {
   L->nny = oldnny;  /* restore 'nny' */
   L->nCcalls--;
   lua_assert(L->nCcalls == ((from) ? from->nCcalls : 0));
+  if (G(L)->threadhook)
+    G(L)->threadhook(L, from, LUA_THREADRETURN);
   lua_unlock(L);
   return status;
 }
@@ -6672,6 +6801,7 @@ Proto *luaF_newproto (lua_State *L) {
   f->sizelocvars = 0;
   f->linedefined = 0;
   f->lastlinedefined = 0;
+  f->hits = NULL;
   f->source = NULL;
   return f;
 }
@@ -6684,10 +6814,23 @@ void luaF_freeproto (lua_State *L, Proto *f) {
   luaM_freearray(L, f->lineinfo, f->sizelineinfo);
   luaM_freearray(L, f->locvars, f->sizelocvars);
   luaM_freearray(L, f->upvalues, f->sizeupvalues);
+  if (f->hits) luaM_freearray(L, f->hits, f->sizecode);
   luaM_free(L, f);
 }
 
 
+/*
+** counters of 'f', allocated when it first runs while counting lines
+*/
+lua_Unsigned *luaF_hits (lua_State *L, Proto *f) {
+  if (f->hits == NULL) {
+    f->hits = luaM_newvector(L, f->sizecode, lua_Unsigned);
+    memset(f->hits, 0, f->sizecode * sizeof(lua_Unsigned));
+  }
+  return f->hits;
+}
+
+
 /*
 ** Look for n-th local variable at line 'line' in function 'func'.
 ** Returns NULL if not found.
@@ -6740,6 +6883,23 @@ const char *luaF_getlocalname (const Proto *f, int local_number, int pc) {
 #define GCFINALIZECOST	GCSWEEPCOST
 
 
+/*
+** monotonic clock for the collector telemetry, in nanoseconds
+*/
+#if !defined(luai_gcclock)
+#include <time.h>
+static lua_Integer luai_gcclock (void) {
+  struct timespec ts;
+#if defined(_WIN32)
+  timespec_get(&ts, TIME_UTC);
+#else
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+  return (lua_Integer)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+
 /*
 ** macro to adjust 'stepmul': 'stepmul' is actually used like
 ** 'stepmul / STEPMULADJ' (value chosen by tests)
@@ -7718,12 +7878,59 @@ static l_mem atomic (lua_State *L) {
 }
 
 
+/*
+** charge the time since the last accounting to the cycle in progress
+*/
+static void accounttime (global_State *g) {
+  lua_Integer now = luai_gcclock();
+  g->gccycle.lastcycletime += now - g->gcclock;
+  g->gcclock = now;
+}
+
+
+/*
+** a cycle reached GCSpause: publish its numbers and start the next one
+*/
+static void endcycle (global_State *g) {
+  lua_GCStats *s = &g->gcstats;
+  lua_GCStats *c = &g->gccycle;
+  accounttime(g);
+  s->cycles++;
+  s->lastcycletime = c->lastcycletime;
+  if (c->lastcycletime > s->maxcycletime) s->maxcycletime = c->lastcycletime;
+  s->lastatomic = c->lastatomic;
+  if (c->lastatomic > s->maxatomic) s->maxatomic = c->lastatomic;
+  s->lastmarked = c->lastmarked;
+  s->lastswept = c->lastswept;
+  s->lastfreed = c->lastfreed;
+  memset(c, 0, sizeof(*c));
+}
+
+
+/*
+** a step or full collection started at 'start' is over
+*/
+static void endpause (global_State *g, lua_Integer start) {
+  lua_GCStats *s = &g->gcstats;
+  lua_Integer pause;
+  int i = 0;
+  accounttime(g);
+  pause = g->gcclock - start;
+  s->totaltime += pause;
+  if (pause > s->maxpause) s->maxpause = pause;
+  while (i < LUA_GCSTATS_BUCKETS - 1 && pause >= ((lua_Integer)1000 << i))
+    i++;
+  s->pauses[i]++;
+}
+
+
 static lu_mem sweepstep (lua_State *L, global_State *g,
                          int nextstate, GCObject **nextlist) {
   if (g->sweepgc) {
     l_mem olddebt = g->GCdebt;
     g->sweepgc = sweeplist(L, g->sweepgc, GCSWEEPMAX);
     g->GCestimate += g->GCdebt - olddebt;  /* update estimate */
+    g->gccycle.lastfreed += olddebt - g->GCdebt;
     if (g->sweepgc)  /* is there still something to sweep? */
       return (GCSWEEPMAX * GCSWEEPCOST);
   }
@@ -7749,14 +7956,21 @@ static lu_mem singlestep (lua_State *L) {
       propagatemark(g);
        if (g->gray == NULL)  /* no more gray objects? */
         g->gcstate = GCSatomic;  /* finish propagate phase */
+      g->gccycle.lastmarked += g->GCmemtrav;
       return g->GCmemtrav;  /* memory traversed in this step */
     }
     case GCSatomic: {
       lu_mem work;
+      lua_Integer t0 = luai_gcclock();
+      g->GCmemtrav = 0;
       propagateall(g);  /* make sure gray list is empty */
+      g->gccycle.lastmarked += g->GCmemtrav;
       work = atomic(L);  /* work is what was traversed by 'atomic' */
       entersweep(L);
       g->GCestimate = gettotalbytes(g);  /* first estimate */;
+      g->gccycle.lastmarked += work;
+      g->gccycle.lastswept = gettotalbytes(g);
+      g->gccycle.lastatomic = luai_gcclock() - t0;
       return work;
     }
     case GCSswpallgc: {  /* sweep "regular" objects */
@@ -7781,6 +7995,7 @@ static lu_mem singlestep (lua_State *L) {
       }
       else {  /* emergency mode or no more finalizers */
         g->gcstate = GCSpause;  /* finish collection */
+        endcycle(g);
         return 0;
       }
     }
@@ -7821,10 +8036,12 @@ static l_mem getdebt (global_State *g) {
 void luaC_step (lua_State *L) {
   global_State *g = G(L);
   l_mem debt = getdebt(g);  /* GC deficit (be paid now) */
+  lua_Integer start;
   if (!g->gcrunning) {  /* not running? */
     luaE_setdebt(g, -GCSTEPSIZE * 10);  /* avoid being called too often */
     return;
   }
+  start = g->gcclock = luai_gcclock();
   do {  /* repeat until pause or enough "credit" (negative debt) */
     lu_mem work = singlestep(L);  /* perform one single step */
     debt -= work;
@@ -7836,6 +8053,8 @@ void luaC_step (lua_State *L) {
     luaE_setdebt(g, debt);
     runafewfinalizers(L);
   }
+  g->gcstats.steps++;
+  endpause(g, start);
 }
 
 
@@ -7850,6 +8069,7 @@ void luaC_step (lua_State *L) {
 */
 void luaC_fullgc (lua_State *L, int isemergency) {
   global_State *g = G(L);
+  lua_Integer start = g->gcclock = luai_gcclock();
   lua_assert(g->gckind == KGC_NORMAL);
   if (isemergency) g->gckind = KGC_EMERGENCY;  /* set flag */
   if (keepinvariant(g)) {  /* black objects? */
@@ -7864,6 +8084,8 @@ void luaC_fullgc (lua_State *L, int isemergency) {
   luaC_runtilstate(L, bitmask(GCSpause));  /* finish collection */
   g->gckind = KGC_NORMAL;
   setpause(g);
+  g->gcstats.fullgcs++;
+  endpause(g, start);
 }
 
 /* }====================================================== */
@@ -13474,6 +13696,8 @@ LUA_API lua_State *lua_newthread (lua_State *L) {
          LUA_EXTRASPACE);
   luai_userstatethread(L, L1);
   stack_init(L1, L);  /* init stack */
+  if (g->threadhook)
+    g->threadhook(L1, L, LUA_THREADNEW);
   lua_unlock(L);
   return L1;
 }
@@ -13525,6 +13749,15 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->gcfinnum = 0;
   g->gcpause = LUAI_GCPAUSE;
   g->gcstepmul = LUAI_GCMUL;
+  memset(&g->gcstats, 0, sizeof(g->gcstats));
+  memset(&g->gccycle, 0, sizeof(g->gccycle));
+  g->gcclock = 0;
+  g->linecount = 0;
+  g->threadhook = NULL;
+#if defined(TLUA_OPCODE_STATS)
+  memset(g->opcounts, 0, sizeof(g->opcounts));
+  memset(g->oppairs, 0, sizeof(g->oppairs));
+#endif
   for (i=0; i < LUA_NUMTAGS; i++) g->mt[i] = NULL;
   if (luaD_rawrunprotected(L, f_luaopen, NULL) != LUA_OK) {
     /* memory allocation error: free partial state */
@@ -17889,11 +18122,27 @@ void luaV_finishOp (lua_State *L) {
            luai_threadyield(L); }
 
 
+/* opcode statistics, see lua_getopstats */
+#if defined(TLUA_OPCODE_STATS)
+#define countop(L,o)	{ global_State *g_ = G(L); \
+  g_->opcounts[o]++; \
+  if (prevop < NUM_OPCODES) g_->oppairs[prevop][o]++; \
+  prevop = (o); }
+#else
+#define countop(L,o)	((void)0)
+#endif
+
+
 /* fetch an instruction and prepare its execution */
 #define vmfetch()	{ \
   i = *(ci->u.l.savedpc++); \
-  if (L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT)) \
-    Protect(luaG_traceexec(L)); \
+  if (hits) hits[pcRel(ci->u.l.savedpc, cl->p)]++; \
+  countop(L, GET_OPCODE(i)); \
+  if (L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT)) { \
+    /* count down a count hook here, 'luaG_traceexec' once it fires */ \
+    if (!(L->hookmask & LUA_MASKLINE) && L->hookcount > 1) L->hookcount--; \
+    else Protect(luaG_traceexec(L)); \
+  } \
   ra = RA(i); /* WARNING: any stack reallocation invalidates 'ra' */ \
   lua_assert(base == ci->u.l.base); \
   lua_assert(base <= L->top && L->top < L->stack + L->stacksize); \
@@ -17925,12 +18174,20 @@ void luaV_execute (lua_State *L) {
   LClosure *cl;
   TValue *k;
   StkId base;
+  lua_Unsigned *hits;
+#if defined(TLUA_OPCODE_STATS)
+  int prevop;
+#endif
   ci->callstatus |= CIST_FRESH;  /* fresh invocation of 'luaV_execute" */
  newframe:  /* reentry point when frame changes (call/return) */
   lua_assert(ci == L->ci);
   cl = clLvalue(ci->func);  /* local reference to function's closure */
   k = cl->p->k;  /* local reference to function's constant table */
   base = ci->u.l.base;  /* local copy of function's base */
+  hits = G(L)->linecount ? luaF_hits(L, cl->p) : NULL;  /* line counts */
+#if defined(TLUA_OPCODE_STATS)
+  prevop = NUM_OPCODES;  /* pairs do not span frames */
+#endif
   /* main loop of interpreter */
   for (;;) {
     Instruction i;
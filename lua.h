@@ -1103,10 +1103,74 @@ LUA_API int (lua_isyieldable) (lua_State *L);
 #define LUA_GCSETPAUSE		6
 #define LUA_GCSETSTEPMUL	7
 #define LUA_GCISRUNNING		9
+#define LUA_GCSTATS		10
 
 LUA_API int (lua_gc) (lua_State *L, int what, int data);
 
 
+/*
+** collector telemetry, see lua_getgcstats. times are in nanoseconds,
+** 'last' fields describe the last completed cycle.
+** lua_gc(L, LUA_GCSTATS, reset) returns the number of completed cycles
+** and clears the counters when 'reset' is not zero.
+*/
+#define LUA_GCSTATS_BUCKETS	16
+
+typedef struct lua_GCStats {
+  lua_Integer cycles;  /* completed cycles */
+  lua_Integer steps;  /* incremental steps */
+  lua_Integer fullgcs;  /* full collections (collectgarbage, emergency) */
+  lua_Integer totaltime;  /* time spent in the collector */
+  lua_Integer maxpause;  /* longest single step or full collection */
+  lua_Integer lastcycletime;  /* collector time spent on the last cycle */
+  lua_Integer maxcycletime;
+  lua_Integer lastatomic;  /* time in the atomic phase of the last cycle */
+  lua_Integer maxatomic;
+  lua_Integer lastmarked;  /* bytes traversed by the last cycle */
+  lua_Integer lastswept;  /* bytes in use when its sweep started */
+  lua_Integer lastfreed;  /* bytes freed by its sweep */
+  /* pauses by duration: [0] under 1us, [i] under 2^i us, the last one the rest */
+  lua_Integer pauses[LUA_GCSTATS_BUCKETS];
+} lua_GCStats;
+
+LUA_API void (lua_getgcstats) (lua_State *L, lua_GCStats *stats);
+
+
+/*
+** per-line execution counts. while counting, a Lua function gets a counter
+** per instruction when it next starts running, which the VM bumps for
+** every instruction executed. lua_getlinecounts reports the lines of all
+** live functions (0 for those that did not run while counting); a line may
+** be reported more than once, its count being the largest.
+*/
+#define LUA_LINECOUNTSTOP	0
+#define LUA_LINECOUNTSTART	1
+#define LUA_LINECOUNTRESET	2
+#define LUA_LINECOUNTISRUNNING	3
+
+typedef void (*lua_LineCount) (void *ud, const char *source, int line,
+                               lua_Unsigned count);
+
+LUA_API int  (lua_linecount) (lua_State *L, int what);
+LUA_API void (lua_getlinecounts) (lua_State *L, lua_LineCount f, void *ud);
+
+
+/*
+** opcode statistics, compiled in when TLUA_OPCODE_STATS is defined: how
+** often each opcode ran, and each pair of opcodes ran one after the other
+** in the same frame. 'counts' gets LUA_NUMOPCODES entries, 'pairs' the
+** square of that, pairs[a * LUA_NUMOPCODES + b] counting a followed by b.
+** either may be NULL.
+*/
+#if defined(TLUA_OPCODE_STATS)
+#define LUA_NUMOPCODES	47
+
+LUA_API void (lua_getopstats) (lua_State *L, lua_Unsigned *counts,
+                               lua_Unsigned *pairs, int reset);
+LUA_API const char *(lua_opname) (int op);
+#endif
+
+
 /*
 ** miscellaneous functions
 */
@@ -1233,6 +1297,22 @@ LUA_API int (lua_gethookmask) (lua_State *L);
 LUA_API int (lua_gethookcount) (lua_State *L);
 
 
+/*
+** thread hook, one per state: called with LUA_THREADNEW when lua_newthread
+** created L from 'from', with LUA_THREADRESUME when lua_resume starts to run
+** L for 'from' and with LUA_THREADRETURN when it returns to it, after a
+** yield, a return or an error. NULL turns it off.
+*/
+#define LUA_THREADNEW		0
+#define LUA_THREADRESUME	1
+#define LUA_THREADRETURN	2
+
+typedef void (*lua_ThreadHook) (lua_State *L, lua_State *from, int event);
+
+LUA_API void (lua_setthreadhook) (lua_State *L, lua_ThreadHook func);
+LUA_API lua_ThreadHook (lua_getthreadhook) (lua_State *L);
+
+
 struct lua_Debug {
   int event;
   const char *name;	/* (n) */
@@ -2025,6 +2105,7 @@ typedef struct Proto {
   LocVar *locvars;  /* information about local variables (debug information) */
   Upvaldesc *upvalues;  /* upvalue information */
   struct LClosure *cache;  /* last-created closure with this prototype */
+  lua_Unsigned *hits;  /* execution counts by instruction, see lua_linecount */
   TString  *source;  /* used for debug information */
   GCObject *gclist;
 } Proto;
@@ -2499,6 +2580,15 @@ typedef struct global_State {
   TString *tmname[TM_N];  /* array with tag-method names */
   struct Table *mt[LUA_NUMTAGS];  /* metatables for basic types */
   TString *strcache[STRCACHE_N][STRCACHE_M];  /* cache for strings in API */
+  lua_GCStats gcstats;  /* collector telemetry */
+  lua_GCStats gccycle;  /* telemetry of the cycle in progress */
+  lua_Integer gcclock;  /* when the running step was last accounted */
+  lu_byte linecount;  /* count executed instructions, see lua_linecount */
+  lua_ThreadHook threadhook;  /* see lua_setthreadhook */
+#if defined(TLUA_OPCODE_STATS)
+  lua_Unsigned opcounts[LUA_NUMOPCODES];
+  lua_Unsigned oppairs[LUA_NUMOPCODES][LUA_NUMOPCODES];
+#endif
 } global_State;
 
 
@@ -3693,6 +3783,7 @@ LUAI_FUNC void luaF_initupvals (lua_State *L, LClosure *cl);
 LUAI_FUNC UpVal *luaF_findupval (lua_State *L, StkId level);
 LUAI_FUNC void luaF_close (lua_State *L, StkId level);
 LUAI_FUNC void luaF_freeproto (lua_State *L, Proto *f);
+LUAI_FUNC lua_Unsigned *luaF_hits (lua_State *L, Proto *f);
 LUAI_FUNC const char *luaF_getlocalname (const Proto *func, int local_number,
                                          int pc);
 
@@ -1,30 +1,729 @@
 #include "stdafx.h"
 #include "tlua.h"
+#include <filesystem>
+#include <chrono>
+#include <exception>
+#include <random>
+#include <atomic>
+#include <algorithm>
+#include <utility>
+#include <string_view>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <unordered_set>
+#include <ctime>
+#include <csignal>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 namespace tlua
 {
     LuaMgr* LuaMgr::instance = nullptr;
     lua_State* LuaObj::L = nullptr;
 
+    static uint64_t fnv1a(const char* p, size_t n)
+    {
+        uint64_t h = 14695981039346656037ull;
+        for (size_t i = 0; i < n; i++) h = (h ^ (unsigned char)p[i]) * 1099511628211ull;
+        return h;
+    }
+
+    static int64_t nowNs()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
 
-    LuaMgr::LuaMgr()
+    // a thread of our own, which the profiler's SIGPROF is not delivered to: its handler
+    // arms the VM thread's hook, a thread blocking it leaves the signal to another one.
+    template<typename F>
+    static std::thread helperThread(F&& f)
     {
-        instance = this;
-        L = luaL_newstate();
+#ifndef _WIN32
+        sigset_t prof, old;
+        sigemptyset(&prof);
+        sigaddset(&prof, SIGPROF);
+        pthread_sigmask(SIG_BLOCK, &prof, &old);
+        std::thread t(std::forward<F>(f));
+        pthread_sigmask(SIG_SETMASK, &old, nullptr);
+        return t;
+#else
+        return std::thread(std::forward<F>(f));
+#endif
+    }
+
+#ifdef TLUA_BINDING_STATS
+    // the C function L is running, null in Lua code. reads only, so a signal handler may call it.
+    static lua_CFunction runningCFunction(lua_State* L)
+    {
+        auto ci = L->ci;
+        if (isLua(ci)) return nullptr;
+        auto func = ci->func;
+        return ttislcf(func) ? fvalue(func) : ttisCclosure(func) ? ((CClosure*)val_(func).gc)->f : nullptr;
+    }
+#endif
+
+    // what a C function goes by in LuaMgr::funcNames. the closures tlua pushes for bound
+    // callables share one C function per signature, so those go by the callable, the
+    // userdata in their first upvalue.
+    static const void* cFuncKey(const TValue* func)
+    {
+        if (ttislcf(func)) return (const void*)fvalue(func);
+        if (!ttisCclosure(func)) return nullptr;
+        auto cl = (CClosure*)val_(func).gc;
+        if (cl->nupvalues && ttislightuserdata(&cl->upvalue[0])) return val_(&cl->upvalue[0]).p;
+        if (cl->nupvalues && ttisfulluserdata(&cl->upvalue[0])) return (char*)val_(&cl->upvalue[0]).gc + sizeof(UUdata);
+        return (const void*)cl->f;
+    }
+
+    static const void* cFuncKey(lua_State* L, int idx)
+    {
+        auto f = lua_tocfunction(L, idx);
+        if (f && lua_getupvalue(L, idx, 1)) {
+            auto callable = lua_touserdata(L, -1);
+            lua_pop(L, 1);
+            if (callable) return callable;
+        }
+        return (const void*)f;
+    }
+
+    // the key of the C function L is running, see runningCFunction.
+    static const void* runningCFuncKey(lua_State* L)
+    {
+        return isLua(L->ci) ? nullptr : cFuncKey(L->ci->func);
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // registry ref accounting, see LuaRefBase::ref
+
+    static LuaMgr::RefStats refCounts = {};
+#ifdef TLUA_REF_TRACKING
+    static unordered_map<int, RefSite> refSites;
+    static RefSite scopeSite;
+    static bool inSiteScope = false;
+#endif
+
+    // the site parameter of the entry points where they are defined, see _TLuaRefSite.
+    // without tracking there is none, and their bodies see this empty one.
+#ifdef TLUA_REF_TRACKING
+#define _TLuaRefSiteParam               RefSite site
+#define _TLuaRefSiteParamArg            , _TLuaRefSiteParam
+#else
+#define _TLuaRefSiteParam
+#define _TLuaRefSiteParamArg
+    static constexpr RefSite site{};
+#endif
+
+    // refs made while a LuaMgr entry point runs are charged to its caller.
+    struct RefSiteScope
+    {
+#ifdef TLUA_REF_TRACKING
+        bool outer;
+        explicit RefSiteScope(const RefSite& site) : outer(!inSiteScope)
+        {
+            if (outer) scopeSite = site;
+            inSiteScope = true;
+        }
+        ~RefSiteScope()
+        {
+            if (outer) inSiteScope = false;
+        }
+#else
+        explicit RefSiteScope(const RefSite&)
+        {}
+#endif
+    };
+
+    //////////////////////////////////////////////////////////////////////////
+    // native class bootstrap, see LuaMgr::setupType.
+
+    // upvalues: class, __prop_get
+    static int classIndex(lua_State* L)
+    {
+        lua_settop(L, 2);
+        lua_pushvalue(L, 2);
+        lua_gettable(L, lua_upvalueindex(2));
+        if (lua_toboolean(L, 3)) {
+            lua_pushvalue(L, 1);
+            lua_call(L, 1, LUA_MULTRET);
+            return lua_gettop(L) - 2;
+        }
+        lua_pushvalue(L, 2);
+        lua_gettable(L, lua_upvalueindex(1));
+        if (lua_toboolean(L, 4)) return 1;
+        lua_getfield(L, lua_upvalueindex(1), "base");
+        if (!lua_toboolean(L, 5)) return 1;
+        lua_getfield(L, 5, "__index");
+        lua_pushvalue(L, 1);
+        lua_pushvalue(L, 2);
+        lua_call(L, 2, 1);
+        return 1;
+    }
+
+    // upvalues: class, __prop_set
+    static int classNewIndex(lua_State* L)
+    {
+        lua_settop(L, 3);
+        lua_pushvalue(L, 2);
+        lua_gettable(L, lua_upvalueindex(2));
+        lua_pushvalue(L, lua_upvalueindex(1));
+        while (!lua_toboolean(L, 4)) {
+            lua_getfield(L, 5, "base");
+            if (!lua_toboolean(L, 6)) return 0;
+            lua_replace(L, 5);
+            lua_getfield(L, 5, "__prop_set");
+            lua_pushvalue(L, 2);
+            lua_gettable(L, 6);
+            lua_replace(L, 4);
+            lua_pop(L, 1);
+        }
+        lua_settop(L, 4);
+        lua_pushvalue(L, 1);
+        lua_pushvalue(L, 3);
+        lua_call(L, 2, LUA_MULTRET);
+        return lua_gettop(L) - 3;
+    }
+
+    // upvalues: class, name, arg counts
+    static int classOverload(lua_State* L)
+    {
+        auto nargs = lua_gettop(L);
+        auto n = (int)lua_rawlen(L, lua_upvalueindex(3));
+        for (int i = 1; i <= n; i++) {
+            lua_rawgeti(L, lua_upvalueindex(3), i);
+            auto needArgs = lua_tointeger(L, -1);
+            lua_pop(L, 1);
+            if (nargs == needArgs) {
+                lua_pushfstring(L, "%s#%d", lua_tostring(L, lua_upvalueindex(2)), nargs);
+                lua_gettable(L, lua_upvalueindex(1));
+                lua_insert(L, 1);
+                lua_call(L, nargs, LUA_MULTRET);
+                return lua_gettop(L);
+            }
+        }
+        return luaL_error(L, "invalid arguments count");
+    }
 
-        luaL_openlibs(L);
+    static int classCall(lua_State* L)
+    {
+        lua_getfield(L, 1, "New");
+        lua_replace(L, 1);
+        lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+        return lua_gettop(L);
+    }
+
+    // upvalue: string.gsub
+    static int stringSplit(lua_State* L)
+    {
+        lua_settop(L, 2);
+        lua_newtable(L);
+        lua_pushvalue(L, lua_upvalueindex(1));
+        lua_pushvalue(L, 1);
+        lua_pushvalue(L, 2);
+        lua_pushvalue(L, 3);
+        lua_pushcclosure(L, [](lua_State* L) {
+            lua_settop(L, 1);
+            lua_rawseti(L, lua_upvalueindex(1), lua_rawlen(L, lua_upvalueindex(1)) + 1);
+            return 0;
+            }, 1);
+        lua_call(L, 3, 0);
+        return 1;
+    }
 
+    //////////////////////////////////////////////////////////////////////////
+    // standard libraries
+
+    struct StdLib
+    {
+        int lib;
+        const char* name;
+        lua_CFunction open;
+        const char* globals[2]; // globals that open the lib lazily
+    };
+
+    static const StdLib stdLibs[] = {
+        { LuaMgr::LibBase, "_G", luaopen_base, {} },
+        { LuaMgr::LibPackage, LUA_LOADLIBNAME, luaopen_package, { LUA_LOADLIBNAME, "require" } },
+        { LuaMgr::LibCoroutine, LUA_COLIBNAME, luaopen_coroutine, { LUA_COLIBNAME } },
+        { LuaMgr::LibTable, LUA_TABLIBNAME, luaopen_table, { LUA_TABLIBNAME } },
+        { LuaMgr::LibIO, LUA_IOLIBNAME, luaopen_io, { LUA_IOLIBNAME } },
+        { LuaMgr::LibOS, LUA_OSLIBNAME, luaopen_os, { LUA_OSLIBNAME } },
+        { LuaMgr::LibString, LUA_STRLIBNAME, luaopen_string, { LUA_STRLIBNAME } },
+        { LuaMgr::LibMath, LUA_MATHLIBNAME, luaopen_math, { LUA_MATHLIBNAME } },
+        { LuaMgr::LibUtf8, LUA_UTF8LIBNAME, luaopen_utf8, { LUA_UTF8LIBNAME } },
+        { LuaMgr::LibDebug, LUA_DBLIBNAME, luaopen_debug, { LUA_DBLIBNAME } },
+#if defined(LUA_COMPAT_BITLIB)
+        { LuaMgr::LibBit32, LUA_BITLIBNAME, luaopen_bit32, { LUA_BITLIBNAME } },
+#endif
 #ifndef TLUA_NO_SOCKET
-        luaopen_socket_core(L);
+        { LuaMgr::LibSocket, "socket.core", luaopen_socket_core, { "socket" } },
+#endif
+    };
+
+    // __index of _G while some libs are lazy. upvalue: global name -> index in stdLibs
+    static int lazyLibIndex(lua_State* L)
+    {
+        lua_settop(L, 2);
+        lua_pushvalue(L, 2);
+        if (lua_rawget(L, lua_upvalueindex(1)) != LUA_TNUMBER)
+            return 0;
+        auto& lib = stdLibs[lua_tointeger(L, -1)];
+        for (auto g : lib.globals) {
+            if (!g) break;
+            lua_pushnil(L);
+            lua_setfield(L, lua_upvalueindex(1), g);
+        }
+        LuaMgr::openLib(L, lib.lib);
+        lua_pushvalue(L, 2);
+        lua_rawget(L, 1);
+        return 1;
+    }
+
+    void LuaMgr::openLib(lua_State* L, int lib)
+    {
+        for (auto& i : stdLibs) {
+            if (i.lib != lib) continue;
+
+            // socket.core registers its own 'socket' global.
+            luaL_requiref(L, i.name, i.open, lib != LibSocket);
+            if (lib == LibPackage) {
+                lua_getfield(L, -1, "searchers");
+                lua_pushcfunction(L, &luaLoader);
+                lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+                lua_pop(L, 1);
+            }
+            else if (lib == LibString) {
+                lua_getfield(L, -1, "gsub");
+                lua_pushcclosure(L, stringSplit, 1);
+                lua_setfield(L, -2, "split");
+            }
+            lua_pop(L, 1);
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // pooled allocator. a block's slab is found from its address, as slabs are aligned
+    // to their size, and lua_Alloc passes the old size back, so blocks carry no header.
+    // a state runs on one thread at a time, so nothing is locked.
+
+    struct LuaMgr::Pool
+    {
+        static constexpr size_t SlabSize = 64 * 1024, Grain = 8, MaxSmall = 256, Classes = MaxSmall / Grain;
+
+        struct Slab
+        {
+            Slab* prev;
+            Slab* next; // in the partial list of its class, or the empty list
+            void* free; // freed blocks, linked through their first word
+            char* bump; // the blocks never handed out start here
+            uint32_t size, live;
+        };
+        static constexpr size_t Header = (sizeof(Slab) + 15) & ~size_t(15);
+
+        Slab* partial[Classes] = {};
+        Slab* empty = nullptr;
+        size_t keepEmpty = 16;
+        PoolStats stats;
+        // malloc blocks shrunk to a small size while no slab could be had.
+        std::unordered_set<void*> keptLarge;
+
+        ~Pool()
+        {
+            // lua_close has freed every block by now, slabs in use would only be leaks.
+            for (auto s : partial)
+                while (s) unmap(std::exchange(s, s->next));
+            trim(0);
+        }
+
+        static Slab* map()
+        {
+#ifdef _WIN32
+            // the allocation granularity is 64K, so this is aligned already.
+            return (Slab*)VirtualAlloc(nullptr, SlabSize, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+            auto p = (char*)mmap(nullptr, SlabSize * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) return nullptr;
+            auto s = (char*)(((uintptr_t)p + SlabSize - 1) & ~(uintptr_t)(SlabSize - 1));
+            if (s > p) munmap(p, s - p);
+            munmap(s + SlabSize, p + SlabSize - s);
+            return (Slab*)s;
+#endif
+        }
+
+        static void unmap(Slab* s)
+        {
+#ifdef _WIN32
+            VirtualFree(s, 0, MEM_RELEASE);
+#else
+            munmap(s, SlabSize);
 #endif
+        }
+
+        void trim(size_t keep)
+        {
+            while (stats.emptySlabs > keep) {
+                unmap(std::exchange(empty, empty->next));
+                stats.emptySlabs--;
+                stats.slabs--;
+                stats.slabsReleased++;
+            }
+        }
+
+        void unlink(Slab* s)
+        {
+            if (s->prev) s->prev->next = s->next;
+            else partial[s->size / Grain - 1] = s->next;
+            if (s->next) s->next->prev = s->prev;
+        }
+
+        void link(Slab* s)
+        {
+            auto& head = partial[s->size / Grain - 1];
+            s->prev = nullptr;
+            s->next = head;
+            if (head) head->prev = s;
+            head = s;
+        }
+
+        static bool full(Slab* s)
+        {
+            return !s->free && s->bump + s->size > (char*)s + SlabSize;
+        }
+
+        void* allocSmall(size_t n)
+        {
+            auto c = (n - 1) / Grain;
+            auto s = partial[c];
+            if (!s) {
+                if (empty) {
+                    s = std::exchange(empty, empty->next);
+                    stats.emptySlabs--;
+                }
+                else {
+                    if (!(s = map())) return nullptr;
+                    stats.slabs++;
+                    stats.slabsMapped++;
+                }
+                s->free = nullptr;
+                s->bump = (char*)s + Header;
+                s->size = (uint32_t)((c + 1) * Grain);
+                s->live = 0;
+                link(s);
+            }
+            void* p;
+            if (s->free) {
+                p = s->free;
+                s->free = *(void**)p;
+            }
+            else {
+                p = s->bump;
+                s->bump += s->size;
+            }
+            s->live++;
+            if (full(s)) unlink(s);
+            return p;
+        }
+
+        void freeSmall(void* p)
+        {
+            auto s = (Slab*)((uintptr_t)p & ~(uintptr_t)(SlabSize - 1));
+            auto wasFull = full(s);
+            *(void**)p = s->free;
+            s->free = p;
+            if (--s->live == 0) {
+                if (!wasFull) unlink(s);
+                s->next = empty;
+                empty = s;
+                stats.emptySlabs++;
+                trim(keepEmpty);
+            }
+            else if (wasFull)
+                link(s);
+        }
+
+        static void* allocf(void* ud, void* ptr, size_t osize, size_t nsize)
+        {
+            auto& pool = *(Pool*)ud;
+            auto old = ptr ? osize : 0; // osize is a type tag for new blocks
+            if (nsize == 0) {
+                if (old > MaxSmall || (ptr && !pool.keptLarge.empty() && pool.keptLarge.erase(ptr))) free(ptr);
+                else if (ptr) pool.freeSmall(ptr);
+                return nullptr;
+            }
+            if (old > MaxSmall && nsize > MaxSmall) {
+                pool.stats.largeAllocs++;
+                auto r = realloc(ptr, nsize);
+                return r || nsize > old ? r : ptr;
+            }
+            if (ptr && old <= MaxSmall && nsize <= MaxSmall && (old - 1) / Grain == (nsize - 1) / Grain)
+                return ptr;
+            void* r;
+            if (nsize <= MaxSmall)
+                r = pool.allocSmall(nsize);
+            else {
+                pool.stats.largeAllocs++;
+                r = malloc(nsize);
+            }
+            if (r && ptr) {
+                memcpy(r, ptr, std::min(old, nsize));
+                allocf(ud, ptr, osize, 0);
+            }
+            else if (!r && nsize < old) {
+                // Lua takes a shrink to always work. the block stays where it is; a slab
+                // block is freed by its slab's class, a malloc one is remembered here.
+                if (old <= MaxSmall) return ptr;
+                try {
+                    pool.keptLarge.insert(ptr);
+                    return ptr;
+                }
+                catch (std::bad_alloc&) {}
+            }
+            return r;
+        }
+    };
+
+    void LuaMgr::setPoolRetention(size_t keepEmpty)
+    {
+        if (!pool) return;
+        pool->keepEmpty = keepEmpty;
+        pool->trim(keepEmpty);
+    }
+
+    LuaMgr::PoolStats LuaMgr::poolStats() const
+    {
+        return pool ? pool->stats : PoolStats();
+    }
+
+    // luaL_newstate's panic function, for states made with lua_newstate.
+    static int panic(lua_State* L)
+    {
+        fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n", lua_tostring(L, -1));
+        return 0;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // memory quota. the allocator setMemoryLimit puts in, keeping count of the bytes in use.
+
+    struct LuaMgr::MemoryQuota
+    {
+        lua_Alloc alloc;
+        void* ud;
+        MemoryUsage usage;
+        function<void(const MemoryUsage&, size_t)> onLimit;
+        // the last growth refused, which Lua asks for again after an emergency collection.
+        bool refused = false;
+        void* refusedPtr = nullptr;
+        size_t refusedSize = 0;
+
+        static void* allocf(void* ud, void* ptr, size_t osize, size_t nsize)
+        {
+            auto& q = *(MemoryQuota*)ud;
+            auto& u = q.usage;
+            auto old = ptr ? osize : 0; // osize is a type tag for new blocks
+            // blocks that shrink or go away must never fail.
+            if (nsize > old) {
+                if (u.limit && u.current - old + nsize > u.limit) {
+                    auto retry = q.refused && q.refusedPtr == ptr && q.refusedSize == nsize;
+                    q.refused = !retry;
+                    q.refusedPtr = ptr;
+                    q.refusedSize = nsize;
+                    if (retry) {
+                        u.failures++;
+                        if (q.onLimit) q.onLimit(u, nsize);
+                    }
+                    return nullptr;
+                }
+                q.refused = false;
+            }
+            auto r = q.alloc(q.ud, ptr, osize, nsize);
+            if (r || !nsize) {
+                u.current = u.current - old + nsize;
+                u.peak = std::max(u.peak, u.current);
+            }
+            return r;
+        }
+    };
+
+    void LuaMgr::setMemoryLimit(size_t limit, function<void(const MemoryUsage&, size_t requested)> onLimit /*= nullptr*/)
+    {
+        if (!quota) {
+            // over the deferred frees, under the memory profiler.
+            quota.reset(new MemoryQuota());
+            innerAlloc(&quota->alloc, &quota->ud);
+            quota->usage.current = quota->usage.peak = (size_t)lua_gc(L, LUA_GCCOUNT, 0) * 1024 + lua_gc(L, LUA_GCCOUNTB, 0);
+            setInnerAlloc(MemoryQuota::allocf, quota.get());
+        }
+        quota->usage.limit = limit;
+        quota->onLimit = std::move(onLimit);
+        quota->refused = false;
+    }
+
+    LuaMgr::MemoryUsage LuaMgr::memoryUsage() const
+    {
+        if (quota) return quota->usage;
+        MemoryUsage u;
+        u.current = u.peak = (size_t)lua_gc(L, LUA_GCCOUNT, 0) * 1024 + lua_gc(L, LUA_GCCOUNTB, 0);
+        return u;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // deferred frees. sits under the quota, so usage drops as soon as Lua lets go.
+    // blocks this big always come from malloc, which any thread may free.
+
+    struct LuaMgr::DeferredFree
+    {
+        struct Block
+        {
+            void* ptr;
+            size_t size;
+        };
+
+        lua_Alloc alloc;
+        void* ud;
+        size_t threshold;
+        vector<Block> queue; // a ring of capacity blocks
+        size_t head = 0, count = 0;
+        DeferredFreeStats stats;
+        std::mutex mutex;
+        std::condition_variable wake;
+        bool stopping = false;
+        std::thread freer;
+
+        DeferredFree(lua_Alloc alloc, void* ud, size_t threshold, size_t capacity)
+            : alloc(alloc), ud(ud), threshold(threshold), queue(std::max<size_t>(capacity, 1))
+        {
+            freer = helperThread([this] {
+                vector<Block> batch;
+                std::unique_lock<std::mutex> lock(mutex);
+                for (;;) {
+                    wake.wait(lock, [this] { return count || stopping; });
+                    if (!count) return;
+                    for (; count; count--, head = (head + 1) % queue.size())
+                        batch.push_back(queue[head]);
+                    lock.unlock();
+                    for (auto& b : batch) this->alloc(this->ud, b.ptr, b.size, 0);
+                    batch.clear();
+                    lock.lock();
+                }
+            });
+        }
+
+        ~DeferredFree()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wake.notify_one();
+            freer.join();
+        }
+
+        static void* allocf(void* ud, void* ptr, size_t osize, size_t nsize)
+        {
+            auto& d = *(DeferredFree*)ud;
+            if (ptr && !nsize && osize >= d.threshold) {
+                std::unique_lock<std::mutex> lock(d.mutex);
+                if (d.count < d.queue.size()) {
+                    d.queue[(d.head + d.count++) % d.queue.size()] = { ptr, osize };
+                    d.stats.deferred++;
+                    auto first = d.count == 1;
+                    lock.unlock();
+                    if (first) d.wake.notify_one();
+                    return nullptr;
+                }
+                d.stats.inlined++;
+            }
+            return d.alloc(d.ud, ptr, osize, nsize);
+        }
+    };
+
+    void LuaMgr::setDeferredFree(size_t threshold, size_t capacity /*= 1024*/)
+    {
+        lua_Alloc f;
+        void* ud;
+        if (quota) {
+            f = quota->alloc;
+            ud = quota->ud;
+        }
+        else
+            innerAlloc(&f, &ud);
+        if (deferredFree) {
+            f = deferredFree->alloc;
+            ud = deferredFree->ud;
+            deferredFree.reset();
+        }
+        if (threshold) {
+            deferredFree.reset(new DeferredFree(f, ud, std::max(threshold, Pool::MaxSmall + 1), capacity));
+            f = DeferredFree::allocf;
+            ud = deferredFree.get();
+        }
+        if (quota) {
+            quota->alloc = f;
+            quota->ud = ud;
+        }
+        else
+            setInnerAlloc(f, ud);
+    }
+
+    LuaMgr::DeferredFreeStats LuaMgr::deferredFreeStats() const
+    {
+        if (!deferredFree) return {};
+        std::lock_guard<std::mutex> lock(deferredFree->mutex);
+        auto s = deferredFree->stats;
+        s.pending = deferredFree->count;
+        return s;
+    }
+
+    LuaMgr::LuaMgr(int libs /*= LibAll*/, int lazyLibs /*= 0*/, Allocator allocator /*= AllocSystem*/)
+    {
+        instance = this;
+        if (allocator == AllocPool) {
+            pool.reset(new Pool());
+            L = lua_newstate(Pool::allocf, pool.get());
+            lua_atpanic(L, panic);
+        }
+        else
+            L = luaL_newstate();
 
-        LuaRef loaders = getGlobal("package")["loaders"];
-        if (loaders.type() != LUA_TTABLE) {
-            loaders = (LuaRef)getGlobal("package")["searchers"];
+        // base only defines globals, it can not be lazy.
+        if (lazyLibs & LibBase) libs |= LibBase;
+        lazyLibs &= ~libs;
+        for (auto& i : stdLibs) {
+            if (libs & i.lib) openLib(L, i.lib);
+        }
+        if (lazyLibs) {
+            lua_pushglobaltable(L);
+            lua_newtable(L);
+            lua_newtable(L);
+            for (auto& i : stdLibs) {
+                if (!(lazyLibs & i.lib)) continue;
+                for (auto g : i.globals) {
+                    if (!g) break;
+                    lua_pushinteger(L, &i - stdLibs);
+                    lua_setfield(L, -2, g);
+                }
+            }
+            lua_pushcclosure(L, lazyLibIndex, 1);
+            lua_setfield(L, -2, "__index");
+            lua_setmetatable(L, -2);
+            lua_pop(L, 1);
         }
-        loaders.append(&luaLoader);
 
         setGlobal("__traceback", &traceback);
+        openTLuaLib(L);
+        funcNames[(const void*)classIndex] = "tlua.index";
+        funcNames[(const void*)classNewIndex] = "tlua.newindex";
+        funcNames[(const void*)classOverload] = "tlua.overload";
+        funcNames[(const void*)classCall] = "tlua.call";
 
         //lua_gc(L, LUA_GCSETSTEPMUL, 1);
 
@@ -33,96 +732,89 @@ namespace tlua
         };
         fileLoader = loadFile;
 
-        auto setupType = doString(R"(
-            function string.split(s, p)
-                local r = {}                
-                string.gsub(s, p, function(c) r[#r+1] = c end)
-                return r
-            end
-
-            local function setupOverloads(class) 
-                local o = {}
-                for k,v in pairs(class) do
-                    if type(v)=='function' then
-                        local p = string.split(k, '([^#]+)')
-                        if #p > 1 then
-                            local name, argcnt = p[1], tonumber(p[2])
-                            o[name] = o[name] or {}
-                            table.insert(o[name], argcnt)
-                        end
-                    end
-                end
-                for k,v in pairs(o) do
-                    class[k] = function(...)
-                        local nargs = select('#',...)
-                        for _, needArgs in ipairs(v) do 
-                            if nargs == needArgs then
-                                return class[k..'#'..nargs](...)
-                            end
-                        end
-                        error('invalid arguments count')
-                    end
-                end
-            end
-
-            local function setupType(typeName)
-				local class = _G[typeName]
-				local pget = class['__prop_get']
-				local pset = class['__prop_set']
-                
-				class._name = typeName
-                if class._lifetime ~= 'cpp' then
-                    class.__gc = class.Delete
-                end
-				
-				if class.base then
-					local baseName = class.base
-					class.base = _G[baseName]
-                    assert(class.base, 'base class not exported:'..baseName)                    				
-                end
-                
-				class.__index = function(t, k)
-					local f = pget[k]
-					if f then return f(t) end
-					local base = class.base
-					return class[k] or (base and base.__index(t, k))
-				end
-				
-				class.__newindex = function(t,k,v)
-					local f = pset[k]
-					local c = class
-					while not f and c.base do 
-						c = c.base
-						f = c.__prop_set[k]
-					end
-					if f then return f(t,v) end
-				end
-                
-				setupOverloads(class)
-
-                local classMt = {}
-                if class.New then
-                    classMt.__call = function(class, ...)
-                        return class.New(...)
-                    end
-                end
-				setmetatable(class, classMt)
-            end
-              
-            return setupType 
-        )");
-
         for (auto i : getRegisters()) { i.second(); }
-        for (auto i : getRegisters()) { setupType.call(i.first); }
+        for (auto i : getRegisters()) {
+            lua_pushcfunction(L, setupType);
+            lua_pushstring(L, i.first.c_str());
+            if (lua_pcall(L, 1, 0, 0)) {
+                logError(lua_tostring(L, -1));
+                lua_pop(L, 1);
+            }
+        }
     }
 
     void LuaMgr::setSourceRoot(string luaRoot /*= ""*/)
     {
         srcDir = luaRoot;
+        missingModules.clear();
+    }
+
+    void LuaMgr::setLoaderPriority(int index)
+    {
+        if (lua_getglobal(L, "package") != LUA_TTABLE) {
+            lua_pop(L, 1);
+            logError("setLoaderPriority: package library not loaded");
+            return;
+        }
+        if (lua_getfield(L, -1, "searchers") != LUA_TTABLE) {
+            lua_pop(L, 1);
+            if (lua_getfield(L, -1, "loaders") != LUA_TTABLE) {
+                lua_pop(L, 2);
+                logError("setLoaderPriority: package.searchers is not a table");
+                return;
+            }
+        }
+
+        // take the loader out, then put it back at index.
+        auto n = (int)lua_rawlen(L, -1);
+        for (int i = 1; i <= n; i++) {
+            lua_rawgeti(L, -1, i);
+            auto found = lua_tocfunction(L, -1) == &luaLoader;
+            lua_pop(L, 1);
+            if (!found) continue;
+            for (; i < n; i++) {
+                lua_rawgeti(L, -1, i + 1);
+                lua_rawseti(L, -2, i);
+            }
+            lua_pushnil(L);
+            lua_rawseti(L, -2, n--);
+            break;
+        }
+        if (index <= 0 || index > n + 1) index = n + 1;
+        for (int i = n; i >= index; i--) {
+            lua_rawgeti(L, -1, i);
+            lua_rawseti(L, -2, i + 1);
+        }
+        lua_pushcfunction(L, &luaLoader);
+        lua_rawseti(L, -2, index);
+        lua_pop(L, 2);
+    }
+
+    void LuaMgr::clearResolveCache()
+    {
+        missingModules.clear();
+    }
+
+    void LuaMgr::setDataChunkLoader(bool enable)
+    {
+        dataChunks = enable;
+    }
+
+    void LuaMgr::setBytecodeCache(string dir /*= ""*/)
+    {
+        cacheDir = dir;
+        if (!cacheDir.empty()) {
+            std::error_code ec;
+            std::filesystem::create_directories(cacheDir, ec);
+        }
     }
 
     LuaMgr::~LuaMgr()
     {
+        stopProfiler();
+        stopMemoryProfiler();
+        stopTrace();
+        stopWatchdog();
         lua_close(L);
         L = nullptr;
     }
@@ -133,8 +825,10 @@ namespace tlua
         return registers;
     }
 
-    tlua::LuaRef LuaMgr::doFile(const char *name)
+    tlua::LuaRef LuaMgr::doFile(const char *name _TLuaRefSiteParamArg)
     {
+        RefSiteScope scope(site);
+        WatchedCall watched(WatchedCall::DoFile, name);
         auto cmd = string("return require('") + name + "')";
         if (luaL_loadstring(L, cmd.c_str())) {
             logError(lua_tostring(L, -1));
@@ -143,23 +837,115 @@ namespace tlua
         return FuncHelper::callLua<LuaRef>();
     }
 
-    tlua::LuaRef LuaMgr::doString(const char* name)
+    tlua::LuaRef LuaMgr::doString(const char* name _TLuaRefSiteParamArg)
     {
-        if (luaL_loadstring(L, name)) {
+        RefSiteScope scope(site);
+        WatchedCall watched(WatchedCall::DoString, name);
+        if (!loadChunk(name)) {
             logError(lua_tostring(L, -1));
             return LuaRef();
         }
         return FuncHelper::callLua<LuaRef>();
     }
 
-    tlua::LuaRef LuaMgr::newTable()
+    lua_GCStats LuaMgr::gcStats(bool reset /*= false*/)
+    {
+        lua_GCStats s;
+        lua_getgcstats(L, &s);
+        if (reset) lua_gc(L, LUA_GCSTATS, 1);
+        return s;
+    }
+
+    void LuaMgr::setChunkCacheCapacity(size_t capacity)
+    {
+        chunkCapacity = capacity;
+        while (chunks.size() > chunkCapacity) {
+            chunkIndex.erase(chunks.back().hash);
+            chunks.pop_back();
+        }
+    }
+
+    LuaMgr::ChunkCacheStats LuaMgr::chunkCacheStats() const
+    {
+        return { chunkHits, chunkMisses, chunks.size(), chunkCapacity };
+    }
+
+    // pushes the compiled chunk, or the error message on failure.
+    bool LuaMgr::loadChunk(const char* source)
     {
+        if (chunkCapacity == 0)
+            return luaL_loadstring(L, source) == LUA_OK;
+
+        auto size = strlen(source);
+        auto hash = fnv1a(source, size);
+        auto it = chunkIndex.find(hash);
+        if (it != chunkIndex.end() && it->second->source.size() == size && memcmp(it->second->source.data(), source, size) == 0) {
+            chunkHits++;
+            chunks.splice(chunks.begin(), chunks, it->second);
+            chunks.front().func.push();
+            return true;
+        }
+
+        chunkMisses++;
+        if (luaL_loadbuffer(L, source, size, source) != LUA_OK)
+            return false;
+        if (it != chunkIndex.end()) {
+            chunks.erase(it->second);
+            chunkIndex.erase(it);
+        }
+        else if (chunks.size() >= chunkCapacity) {
+            chunkIndex.erase(chunks.back().hash);
+            chunks.pop_back();
+        }
+        chunks.push_front({ hash, string(source, size), LuaRef::fromIndex(-1) });
+        chunkIndex[hash] = chunks.begin();
+        return true;
+    }
+
+    tlua::LuaRef LuaMgr::newTable(_TLuaRefSiteParam)
+    {
+        RefSiteScope scope(site);
         lua_newtable(L);
         return LuaRef::fromStack();
     }
 
-    tlua::LuaRef LuaMgr::getGlobal(const char* name)
+    void LuaMgr::registerType(const char* name, lua_CFunction deleter, const TypeReg* regs)
+    {
+        int counts[4] = {};
+        for (auto r = regs; r->name; r++) counts[r->kind]++;
+
+        // reserve room for the fields added by setupType as well.
+        lua_createtable(L, 0, counts[TypeReg::Func] + counts[TypeReg::Value] + 8);
+        lua_pushcfunction(L, deleter);
+        lua_setfield(L, -2, "Delete");
+        funcNames[(const void*)deleter] = string(name) + ".Delete";
+        lua_createtable(L, 0, counts[TypeReg::Getter]);
+        lua_createtable(L, 0, counts[TypeReg::Setter]);
+
+        for (auto r = regs; r->name; r++) {
+            if (r->kind == TypeReg::Value)
+                r->func(L);
+            else {
+                lua_pushcfunction(L, r->func);
+                funcNames[(const void*)r->func] = string(name) + "." + r->name;
+            }
+            auto table = r->kind == TypeReg::Getter ? -3 : r->kind == TypeReg::Setter ? -2 : -4;
+            lua_setfield(L, table, r->name);
+        }
+
+        lua_setfield(L, -3, "__prop_set");
+        lua_setfield(L, -2, "__prop_get");
+        lua_setglobal(L, name);
+    }
+
+    void LuaMgr::nameFunction(const char* name)
+    {
+        if (lua_iscfunction(L, -1)) funcNames.emplace(cFuncKey(L, -1), name);
+    }
+
+    tlua::LuaRef LuaMgr::getGlobal(const char* name _TLuaRefSiteParamArg)
     {
+        RefSiteScope scope(site);
         lua_getglobal(L, name);
         return LuaRef::fromStack();
     }
@@ -169,14 +955,114 @@ namespace tlua
         string ret;
         if (FILE* f = fopen(name, "rb")) {
             fseek(f, 0, SEEK_END);
-            ret.resize(ftell(f));
+            auto size = ftell(f);
             fseek(f, 0, SEEK_SET);
-            fread((void*)ret.data(), ret.size(), 1, f);
+            if (size > 0) {
+                ret.resize(size);
+                if (fread((void*)ret.data(), ret.size(), 1, f) != 1)
+                    ret.clear();
+            }
             fclose(f);
         }
         return ret;
     }
 
+    int LuaMgr::setupType(lua_State* L)
+    {
+        auto typeName = luaL_checkstring(L, 1);
+        if (lua_getglobal(L, typeName) != LUA_TTABLE)
+            return luaL_error(L, "type not registered: %s", typeName);
+        auto cls = lua_gettop(L);
+        lua_getfield(L, cls, "__prop_get");
+        lua_getfield(L, cls, "__prop_set");
+
+        lua_pushvalue(L, 1);
+        lua_setfield(L, cls, "_name");
+        lua_getfield(L, cls, "_lifetime");
+        auto lifetime = lua_type(L, -1) == LUA_TSTRING ? lua_tostring(L, -1) : "";
+        if (strcmp(lifetime, "cpp") != 0) {
+            lua_getfield(L, cls, "Delete");
+            lua_setfield(L, cls, "__gc");
+        }
+        lua_pop(L, 1);
+
+        lua_getfield(L, cls, "base");
+        if (lua_toboolean(L, -1)) {
+            lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+            lua_pushvalue(L, -2);
+            lua_gettable(L, -2);
+            lua_pushvalue(L, -1);
+            lua_setfield(L, cls, "base");
+            if (lua_isnil(L, -1))
+                return luaL_error(L, "base class not exported:%s", lua_tostring(L, -3));
+        }
+        lua_settop(L, cls + 2);
+
+        lua_pushvalue(L, cls);
+        lua_pushvalue(L, cls + 1);
+        lua_pushcclosure(L, classIndex, 2);
+        lua_setfield(L, cls, "__index");
+        lua_pushvalue(L, cls);
+        lua_pushvalue(L, cls + 2);
+        lua_pushcclosure(L, classNewIndex, 2);
+        lua_setfield(L, cls, "__newindex");
+
+        setupOverloads(L, cls);
+
+        lua_newtable(L);
+        lua_getfield(L, cls, "New");
+        if (lua_toboolean(L, -1)) {
+            lua_pushcfunction(L, classCall);
+            lua_setfield(L, -3, "__call");
+        }
+        lua_pop(L, 1);
+        lua_setmetatable(L, cls);
+        return 0;
+    }
+
+    void LuaMgr::setupOverloads(lua_State* L, int cls)
+    {
+        // "name#argcnt" entries are collected into overloads[name] = { argcnt... }
+        lua_newtable(L);
+        auto overloads = lua_gettop(L);
+        lua_pushnil(L);
+        while (lua_next(L, cls)) {
+            if (lua_type(L, -1) == LUA_TFUNCTION && lua_type(L, -2) == LUA_TSTRING) {
+                std::vector<string> p;
+                for (auto k = lua_tostring(L, -2); *k;) {
+                    auto n = strcspn(k, "#");
+                    if (n) p.emplace_back(k, n);
+                    k += n + (k[n] ? 1 : 0);
+                }
+                if (p.size() > 1) {
+                    if (lua_getfield(L, overloads, p[0].c_str()) != LUA_TTABLE) {
+                        lua_pop(L, 1);
+                        lua_newtable(L);
+                        lua_pushvalue(L, -1);
+                        lua_setfield(L, overloads, p[0].c_str());
+                    }
+                    if (lua_stringtonumber(L, p[1].c_str()))
+                        lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+                    lua_pop(L, 1);
+                }
+            }
+            lua_pop(L, 1);
+        }
+
+        lua_pushnil(L);
+        while (lua_next(L, overloads)) {
+            lua_pushvalue(L, cls);
+            lua_pushvalue(L, -3);
+            lua_pushvalue(L, -3);
+            lua_pushcclosure(L, classOverload, 3);
+            lua_pushvalue(L, -3);
+            lua_insert(L, -2);
+            lua_settable(L, cls);
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+    }
+
     void LuaMgr::traceback(const char* msg)
     {
         auto ignoreFuncStackCnt = 2;// debug.traceback + __traceback        
@@ -185,38 +1071,3294 @@ namespace tlua
 
     const char* LuaMgr::getCallStack(const char* msg, int ignoreFuncStackCnt)
     {
-        auto stack = instance->getGlobal("debug")["traceback"].call<const char*>(msg, ignoreFuncStackCnt);
-        return stack;
+        // level 0 is the C function calling us, which debug.traceback used to count as 1.
+        luaL_traceback(L, L, msg, ignoreFuncStackCnt > 0 ? ignoreFuncStackCnt - 1 : 0);
+        callStack = lua_tostring(L, -1);
+        lua_pop(L, 1);
+        return callStack.c_str();
     }
 
-    int LuaMgr::luaLoader(lua_State* L)
+    // stops the collector for as long as it lives, unless it was stopped already.
+    struct GcPause
     {
-        string requireFile = lua_tostring(L, -1);
-        while (auto c = strchr(&requireFile[0], '.')) *c = '/';
-        requireFile += ".lua";
-        auto filePath = instance->srcDir + "/" + requireFile;
-        auto chunk = instance->loadFile(filePath.c_str());
-        if (chunk.size() == 0) {
-            instance->logError(Sprintf("can not get file data of %s", filePath.c_str()).c_str());
-            return 0;
+        lua_State* L;
+        bool running;
+        explicit GcPause(lua_State* L) : L(L), running(lua_gc(L, LUA_GCISRUNNING, 0) != 0)
+        {
+            lua_gc(L, LUA_GCSTOP, 0);
         }
-        auto err = luaL_loadbuffer(L, chunk.data(), chunk.size(), requireFile.c_str());
-        if (err == LUA_ERRSYNTAX) {
-            instance->logError(Sprintf("syntax error in %s", filePath.c_str()).c_str());
-            return 0;
+        ~GcPause() { if (running) lua_gc(L, LUA_GCRESTART, 0); }
+    };
+
+    //////////////////////////////////////////////////////////////////////////
+    // data-only chunks: 'return { ... }' made of literal keys and values is built
+    // straight into presized tables, without generating bytecode. anything else
+    // is rejected and left to the compiler.
+
+    class DataChunk
+    {
+    public:
+        DataChunk(lua_State* L, const char* data, size_t size) : L(L), p(data), end(data + size)
+        {}
+
+        // pushes the table on success, leaves the stack untouched otherwise.
+        bool load()
+        {
+            // nothing built here becomes garbage, so collecting meanwhile only re-marks the new tables.
+            GcPause pause(L);
+
+            auto top = lua_gettop(L);
+            next();
+            auto ok = tok == TName && text == "return";
+            if (ok) next();
+            ok = ok && isChar('{') && table(0);
+            if (ok && isChar(';')) next();
+            if (!ok || tok != TEnd) {
+                lua_settop(L, top);
+                return false;
+            }
+            return true;
         }
-        return 1;
+
+    private:
+        enum Token { TEnd, TError, TName, TNumber, TString, TChar };
+        enum { Positional, Keyed };
+
+        // the fields of a table are collected on the stack first, so it can be created
+        // with exact array and hash sizes. tables too big for the stack are created
+        // early and filled directly from then on.
+        bool table(int depth)
+        {
+            if (depth >= LUAI_MAXCCALLS) return false;
+
+            auto base = lua_gettop(L);
+            auto kindsBase = kinds.size();
+            int t = 0, narr = 0, nhash = 0, pending = 0;
+
+            next();
+            while (!isChar('}')) {
+                if (!t && !lua_checkstack(L, LFIELDS_PER_FLUSH + 8)) {
+                    create(base, kindsBase, narr, nhash);
+                    t = base + 1;
+                }
+
+                auto keyed = true;
+                if (isChar('[')) {
+                    next();
+                    if (!key() || !isChar(']')) return false;
+                    next();
+                    if (!isChar('=')) return false;
+                    next();
+                }
+                else if (tok == TName && nextIsAssign()) {
+                    if (isReserved(text)) return false;
+                    lua_pushlstring(L, text.data(), text.size());
+                    next();
+                    next();
+                }
+                else {
+                    keyed = false;
+                }
+                if (!value(depth)) return false;
+
+                if (keyed) {
+                    nhash++;
+                    if (t) lua_rawset(L, t); else kinds.push_back(Keyed);
+                }
+                else {
+                    narr++;
+                    if (!t) kinds.push_back(Positional);
+                    else if (++pending == LFIELDS_PER_FLUSH) flush(t, narr, pending);
+                }
+
+                if (isChar(',') || isChar(';'))
+                    next();
+                else if (!isChar('}'))
+                    return false;
+            }
+            next();
+
+            if (t) {
+                flush(t, narr, pending);
+            }
+            else {
+                create(base, kindsBase, narr, nhash);
+            }
+            kinds.resize(kindsBase);
+            return true;
+        }
+
+        // replaces the fields collected above base with the table holding them.
+        void create(int base, size_t kindsBase, int narr, int nhash)
+        {
+            lua_createtable(L, narr, nhash);
+            replay(base, kindsBase);
+            if (lua_gettop(L) > base + 1) {
+                lua_replace(L, base + 1);
+                lua_settop(L, base + 1);
+            }
+        }
+
+        // sets the collected fields into the table on the top, in source order. positional
+        // items go in every LFIELDS_PER_FLUSH like OP_SETLIST does, so mixing them with
+        // explicit integer keys gives the compiler's result.
+        void replay(int base, size_t kindsBase)
+        {
+            auto t = lua_gettop(L);
+            int idx = base + 1, narr = 0, pending = 0, positions[LFIELDS_PER_FLUSH];
+            auto flushPending = [&] {
+                for (int i = 0; i < pending; i++) {
+                    lua_pushvalue(L, positions[i]);
+                    lua_rawseti(L, t, narr - pending + i + 1);
+                }
+                pending = 0;
+            };
+            for (auto i = kindsBase; i < kinds.size(); i++) {
+                if (kinds[i] == Keyed) {
+                    lua_pushvalue(L, idx);
+                    lua_pushvalue(L, idx + 1);
+                    lua_rawset(L, t);
+                    idx += 2;
+                }
+                else {
+                    positions[pending++] = idx++;
+                    narr++;
+                    if (pending == LFIELDS_PER_FLUSH) flushPending();
+                }
+            }
+            flushPending();
+        }
+
+        // sets the pending positional items on the top of the stack.
+        void flush(int t, int narr, int& pending)
+        {
+            for (int i = pending; i > 0; i--) lua_rawseti(L, t, narr - pending + i);
+            pending = 0;
+        }
+
+        bool key()
+        {
+            if (tok == TString || tok == TNumber || isChar('-')) return scalar();
+            if (tok == TName && (text == "true" || text == "false")) return scalar();
+            return false;
+        }
+
+        bool value(int depth)
+        {
+            if (isChar('{')) return table(depth + 1);
+            if (tok == TName && text == "nil") {
+                lua_pushnil(L);
+                next();
+                return true;
+            }
+            return key();
+        }
+
+        bool scalar()
+        {
+            auto negate = isChar('-');
+            if (negate) next();
+            if (tok == TNumber) {
+                if (!pushNumber()) return false;
+                if (negate) {
+                    if (lua_isinteger(L, -1))
+                        lua_pushinteger(L, (lua_Integer)(0u - (lua_Unsigned)lua_tointeger(L, -1)));
+                    else
+                        lua_pushnumber(L, -lua_tonumber(L, -1));
+                    lua_replace(L, -2);
+                }
+            }
+            else if (negate) {
+                return false;
+            }
+            else if (tok == TString) {
+                lua_pushlstring(L, text.data(), text.size());
+            }
+            else {
+                lua_pushboolean(L, text == "true");
+            }
+            next();
+            return true;
+        }
+
+        bool pushNumber()
+        {
+            // plain decimal integers are the common case, the rest goes through the
+            // same conversion the compiler uses.
+            if (text.size() < 19 && text.find_first_not_of("0123456789") == string_view::npos) {
+                lua_Integer v = 0;
+                for (auto c : text) v = v * 10 + (c - '0');
+                lua_pushinteger(L, v);
+                return true;
+            }
+            buf.assign(text.data(), text.size());
+            return lua_stringtonumber(L, buf.c_str()) == buf.size() + 1;
+        }
+
+        bool isChar(char c) const
+        {
+            return tok == TChar && text[0] == c;
+        }
+
+        static bool isReserved(string_view s)
+        {
+            static const char* words[] = { "and", "break", "do", "else", "elseif", "end", "false", "for", "function", "goto", "if",
+                "in", "local", "nil", "not", "or", "repeat", "return", "then", "true", "until", "while" };
+            if (s.size() < 2 || s.size() > 8 || !islower((unsigned char)s[0])) return false;
+            for (auto w : words) if (s == w) return true;
+            return false;
+        }
+
+        //////////////////////////////////////////////////////////////////////////
+        // lexer, following llex.c for the subset above
+
+        static bool isSpace(char c) { return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\v' || c == '\f'; }
+        static bool isAlpha(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_'; }
+        static bool isDigit(char c) { return c >= '0' && c <= '9'; }
+        static bool isXDigit(char c) { return isDigit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F'); }
+
+        bool nextIsAssign()
+        {
+            auto saved = p;
+            auto ok = skipSpace() && p < end && *p == '=' && (p + 1 == end || p[1] != '=');
+            p = saved;
+            return ok;
+        }
+
+        bool skipSpace()
+        {
+            while (p < end) {
+                if (isSpace(*p)) {
+                    p++;
+                }
+                else if (*p == '-' && p + 1 < end && p[1] == '-') {
+                    p += 2;
+                    if (p < end && *p == '[' && longBracket(false)) continue;
+                    while (p < end && *p != '\n' && *p != '\r') p++;
+                }
+                else {
+                    break;
+                }
+            }
+            return !failed;
+        }
+
+        void next()
+        {
+            if (!skipSpace()) { tok = TError; return; }
+            if (p == end) { tok = TEnd; text = {}; return; }
+
+            auto s = p;
+            auto c = *p;
+            if (isAlpha(c)) {
+                while (p < end && (isAlpha(*p) || isDigit(*p))) p++;
+                text = string_view(s, p - s);
+                tok = TName;
+            }
+            else if (isDigit(c) || (c == '.' && p + 1 < end && isDigit(p[1]))) {
+                auto expo = "Ee";
+                if (c == '0' && p + 1 < end && (p[1] == 'x' || p[1] == 'X')) {
+                    expo = "Pp";
+                    p += 2;
+                }
+                while (p < end) {
+                    if (*p == expo[0] || *p == expo[1]) {
+                        p++;
+                        if (p < end && (*p == '+' || *p == '-')) p++;
+                    }
+                    else if (isXDigit(*p) || *p == '.') {
+                        p++;
+                    }
+                    else {
+                        break;
+                    }
+                }
+                text = string_view(s, p - s);
+                tok = TNumber;
+            }
+            else if (c == '"' || c == '\'') {
+                tok = shortString() ? TString : TError;
+            }
+            else if (c == '[' && p + 1 < end && (p[1] == '[' || p[1] == '=')) {
+                tok = longBracket(true) ? TString : TError;
+            }
+            else {
+                text = string_view(p++, 1);
+                tok = TChar;
+            }
+        }
+
+        // [==[ ... ]==], p at the first '['. returns false if it is not a long bracket.
+        bool longBracket(bool keep)
+        {
+            auto s = p + 1;
+            while (s < end && *s == '=') s++;
+            if (s == end || *s != '[') {
+                if (keep) failed = true;
+                return false;
+            }
+            auto level = s - p - 1;
+            p = s + 1;
+            if (p < end && (*p == '\n' || *p == '\r')) skipNewline();
+            // a comment may come between a name and its '=', text still holds the name then.
+            if (keep) buf.clear();
+            for (;;) {
+                if (p == end) {
+                    failed = true;
+                    return false;
+                }
+                if (*p == ']') {
+                    auto e = p + 1;
+                    while (e < end && *e == '=') e++;
+                    if (e < end && *e == ']' && e - p - 1 == level) {
+                        p = e + 1;
+                        if (keep) text = buf;
+                        return true;
+                    }
+                    if (keep) buf += *p;
+                    p++;
+                }
+                else if (*p == '\n' || *p == '\r') {
+                    skipNewline();
+                    if (keep) buf += '\n';
+                }
+                else {
+                    if (keep) buf += *p;
+                    p++;
+                }
+            }
+        }
+
+        void skipNewline()
+        {
+            auto c = *p++;
+            if (p < end && (*p == '\n' || *p == '\r') && *p != c) p++;
+        }
+
+        bool shortString()
+        {
+            auto quote = *p++;
+            auto s = p;
+            while (p < end && *p != quote && *p != '\\' && *p != '\n' && *p != '\r') p++;
+            if (p < end && *p == quote) {
+                text = string_view(s, p++ - s);
+                return true;
+            }
+
+            // escapes need decoding.
+            buf.assign(s, p - s);
+            for (;;) {
+                if (p == end || *p == '\n' || *p == '\r') return false;
+                auto c = *p++;
+                if (c == quote) {
+                    text = buf;
+                    return true;
+                }
+                if (c != '\\') {
+                    buf += c;
+                    continue;
+                }
+                if (p == end) return false;
+                c = *p;
+                switch (c) {
+                case 'a': buf += '\a'; p++; break;
+                case 'b': buf += '\b'; p++; break;
+                case 'f': buf += '\f'; p++; break;
+                case 'n': buf += '\n'; p++; break;
+                case 'r': buf += '\r'; p++; break;
+                case 't': buf += '\t'; p++; break;
+                case 'v': buf += '\v'; p++; break;
+                case '\\': case '"': case '\'': buf += c; p++; break;
+                case '\n': case '\r': skipNewline(); buf += '\n'; break;
+                case 'x': {
+                    if (end - p < 3 || !isXDigit(p[1]) || !isXDigit(p[2])) return false;
+                    buf += (char)(hexValue(p[1]) * 16 + hexValue(p[2]));
+                    p += 3;
+                    break;
+                }
+                case 'z': {
+                    p++;
+                    while (p < end && isSpace(*p)) {
+                        if (*p == '\n' || *p == '\r') skipNewline(); else p++;
+                    }
+                    break;
+                }
+                case 'u': {
+                    if (++p == end || *p++ != '{') return false;
+                    unsigned long r = 0;
+                    auto digits = 0;
+                    for (; p < end && isXDigit(*p); p++, digits++) {
+                        r = (r << 4) + hexValue(*p);
+                        if (r > 0x7FFFFFFFul) return false;
+                    }
+                    if (!digits || p == end || *p++ != '}') return false;
+                    char utf8[UTF8BUFFSZ];
+                    auto n = luaO_utf8esc(utf8, r);
+                    buf.append(utf8 + UTF8BUFFSZ - n, n);
+                    break;
+                }
+                default: {
+                    if (!isDigit(c)) return false;
+                    int r = 0;
+                    for (int i = 0; i < 3 && p < end && isDigit(*p); i++, p++) r = 10 * r + *p - '0';
+                    if (r > UCHAR_MAX) return false;
+                    buf += (char)r;
+                }
+                }
+            }
+        }
+
+        static int hexValue(char c)
+        {
+            return isDigit(c) ? c - '0' : (c | 0x20) - 'a' + 10;
+        }
+
+        lua_State* L;
+        const char* p;
+        const char* end;
+        Token tok = TEnd;
+        string_view text; // current token, points into the chunk or buf
+        string buf;
+        bool failed = false;
+        std::vector<char> kinds; // Positional or Keyed for the fields collected on the stack
+    };
+
+#ifdef TLUA_CHECK_DATA_CHUNKS
+    // the values at a and b are equal, tables compared by content. keys of data
+    // chunks are literals, so each key of a can be looked up in b directly.
+    static bool sameData(lua_State* L, int a, int b, int depth = 0)
+    {
+        a = lua_absindex(L, a);
+        b = lua_absindex(L, b);
+        if (lua_type(L, a) != lua_type(L, b) || lua_isinteger(L, a) != lua_isinteger(L, b))
+            return false;
+        if (!lua_istable(L, a))
+            return lua_rawequal(L, a, b) != 0;
+        if (depth >= LUAI_MAXCCALLS)
+            return false;
+        ptrdiff_t n = 0;
+        lua_pushnil(L);
+        while (lua_next(L, a)) {
+            n++;
+            lua_pushvalue(L, -2);
+            lua_rawget(L, b);
+            auto same = sameData(L, -2, -1, depth + 1);
+            lua_pop(L, 2);
+            if (!same) {
+                lua_pop(L, 1);
+                return false;
+            }
+        }
+        lua_pushnil(L);
+        while (lua_next(L, b)) {
+            n--;
+            lua_pop(L, 1);
+        }
+        return n == 0;
+    }
+#endif
+
+    // pushes a loader returning the table built from a data-only chunk.
+    static bool loadDataChunk(lua_State* L, const char* data, size_t size)
+    {
+        if (!DataChunk(L, data, size).load()) return false;
+#ifdef TLUA_CHECK_DATA_CHUNKS
+        // the compiler has the last word: on any difference its table is used.
+        auto ok = luaL_loadbuffer(L, data, size, "=data chunk") == LUA_OK && lua_pcall(L, 0, 1, 0) == LUA_OK && sameData(L, -2, -1);
+        lua_pop(L, 1);
+        if (!ok) {
+            lua_pop(L, 1);
+            LuaMgr::get()->logError(("data chunk loader differs from the compiler: " + string(data, std::min<size_t>(size, 60))).c_str());
+            return false;
+        }
+#endif
+        lua_pushcclosure(L, [](lua_State* L) {
+            lua_pushvalue(L, lua_upvalueindex(1));
+            return 1;
+            }, 1);
+        return true;
+    }
+
+    int LuaMgr::luaLoader(lua_State* L)
+    {
+        auto name = lua_tostring(L, 1);
+        if (instance->loadPacked(name) || instance->loadPrecompiled(name))
+            return 1;
+
+        // known misses go straight to the next searcher, without touching the filesystem.
+        auto& missing = instance->missingModules;
+        if (missing.count(name)) {
+            lua_pushfstring(L, "\n\tno module '%s' in '%s' (cached)", name, instance->srcDir.c_str());
+            return 1;
+        }
+
+        string requireFile = name;
+        while (auto c = strchr(&requireFile[0], '.')) *c = '/';
+        requireFile += ".lua";
+        auto filePath = instance->srcDir + "/" + requireFile;
+        if (instance->loadCached(filePath, nullptr, 0))
+            return 1;
+
+        // the default loader maps the file and compiles straight from the mapping.
+        MappedFile file;
+        string text;
+        auto defaultLoader = instance->fileLoader.target<string(*)(const char*)>();
+        if (defaultLoader && *defaultLoader == &loadFile)
+            file.open(filePath.c_str());
+        else
+            text = instance->fileLoader(filePath.c_str());
+        // an empty file is a module too, only a custom loader's empty string is a miss.
+        auto chunk = file.isOpen() ? (file.data() ? file.data() : "") : text.data();
+        auto size = file.isOpen() ? file.size() : text.size();
+        if (!file.isOpen() && size == 0) {
+            missing.insert(name);
+            lua_pushfstring(L, "\n\tno file '%s'%s%s", filePath.c_str(), file.error().empty() ? "" : ": ", file.error().c_str());
+            return 1;
+        }
+
+        if (instance->loadCached(filePath, chunk, size))
+            return 1;
+        if (instance->dataChunks && loadDataChunk(L, chunk, size))
+            return 1;
+        auto err = luaL_loadbuffer(L, chunk, size, requireFile.c_str());
+        if (err == LUA_ERRSYNTAX) {
+            instance->logError(Sprintf("syntax error in %s", filePath.c_str()).c_str());
+            return 0;
+        }
+        if (err == LUA_OK)
+            instance->saveCached(filePath, chunk, size);
+        return 1;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // file mapping
+
+    MappedFile::MappedFile(const char* path)
+    {
+        open(path);
+    }
+
+    MappedFile::MappedFile(MappedFile&& other)
+    {
+        *this = move(other);
+    }
+
+    MappedFile& MappedFile::operator=(MappedFile&& other)
+    {
+        if (this != &other) {
+            close();
+            m_data = other.m_data;
+            m_size = other.m_size;
+            m_mapping = other.m_mapping;
+            m_open = other.m_open;
+            m_error = move(other.m_error);
+            other.m_data = nullptr;
+            other.m_size = 0;
+            other.m_mapping = nullptr;
+            other.m_open = false;
+        }
+        return *this;
+    }
+
+    MappedFile::~MappedFile()
+    {
+        close();
+    }
+
+#ifdef _WIN32
+
+    bool MappedFile::open(const char* path)
+    {
+        close();
+        auto file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            m_error = Sprintf("open failed (%lu)", GetLastError());
+            return false;
+        }
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file, &size)) {
+            m_error = Sprintf("stat failed (%lu)", GetLastError());
+            CloseHandle(file);
+            return false;
+        }
+        if (size.QuadPart > 0) {
+            m_mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            m_data = m_mapping ? (const char*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+            if (!m_data) {
+                m_error = Sprintf("mmap failed (%lu)", GetLastError());
+                if (m_mapping) CloseHandle(m_mapping);
+                m_mapping = nullptr;
+                CloseHandle(file);
+                return false;
+            }
+        }
+        CloseHandle(file);
+        m_size = (size_t)size.QuadPart;
+        m_open = true;
+        return true;
+    }
+
+    void MappedFile::close()
+    {
+        if (m_data) UnmapViewOfFile(m_data);
+        if (m_mapping) CloseHandle(m_mapping);
+        m_data = nullptr;
+        m_mapping = nullptr;
+        m_size = 0;
+        m_open = false;
+    }
+
+#else
+
+    bool MappedFile::open(const char* path)
+    {
+        close();
+        auto fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            m_error = Sprintf("open failed: %s", strerror(errno));
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            m_error = Sprintf("stat failed: %s", strerror(errno));
+            ::close(fd);
+            return false;
+        }
+        if (st.st_size > 0) {
+            auto p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                m_error = Sprintf("mmap failed: %s", strerror(errno));
+                ::close(fd);
+                return false;
+            }
+            m_data = (const char*)p;
+        }
+        ::close(fd);
+        m_size = (size_t)st.st_size;
+        m_open = true;
+        return true;
+    }
+
+    void MappedFile::close()
+    {
+        if (m_data) munmap((void*)m_data, m_size);
+        m_data = nullptr;
+        m_size = 0;
+        m_open = false;
+    }
+
+#endif
+
+    //////////////////////////////////////////////////////////////////////////
+    // bytecode cache
+
+    struct BytecodeHeader
+    {
+        char magic[4];
+        int64_t mtime;
+        uint64_t size;
+        uint64_t hash;
+    };
+
+    static const char bytecodeMagic[4] = { 'T', 'L', 'C', '1' };
+
+    static string bytecodePath(const string& dir, const string& path)
+    {
+        return dir + "/" + Sprintf("%016llx", (unsigned long long)fnv1a(path.data(), path.size())) + ".luac";
+    }
+
+    // appends the bytecode of the function on the top of the stack.
+    static bool dumpFunction(lua_State* L, string& out)
+    {
+        auto writer = [](lua_State*, const void* p, size_t sz, void* ud) {
+            ((string*)ud)->append((const char*)p, sz);
+            return 0;
+        };
+        return lua_dump(L, writer, &out, 0) == 0;
+    }
+
+    // writes to a private temp file and renames it over, so readers never see a partial file.
+    static bool writeFileAtomic(const string& file, const string& data)
+    {
+        static std::atomic<unsigned> seq;
+        auto tmp = file + Sprintf(".%llx%x.tmp", (long long)std::chrono::steady_clock::now().time_since_epoch().count(), ++seq);
+        auto f = fopen(tmp.c_str(), "wb");
+        if (!f) return false;
+        auto ok = fwrite(data.data(), data.size(), 1, f) == 1;
+        ok = fclose(f) == 0 && ok;
+        std::error_code ec;
+        if (ok) std::filesystem::rename(tmp, file, ec);
+        if (!ok || ec) std::filesystem::remove(tmp, ec);
+        return ok && !ec;
+    }
+
+    static bool statFile(const string& path, int64_t& mtime, uint64_t& size)
+    {
+        std::error_code ec;
+        auto t = std::filesystem::last_write_time(path, ec);
+        if (ec) return false;
+        size = std::filesystem::file_size(path, ec);
+        if (ec) return false;
+        mtime = (int64_t)t.time_since_epoch().count();
+        return true;
+    }
+
+    // pushes the cached function. without the source (chunk == nullptr) only
+    // mtime/size are checked, otherwise the content hash tells a touched file
+    // from a modified one, and a touched file gets its stamp renewed.
+    bool LuaMgr::loadCached(const string& path, const char* chunk, size_t size)
+    {
+        if (cacheDir.empty()) return false;
+
+        MappedFile data(bytecodePath(cacheDir, path).c_str());
+        BytecodeHeader h;
+        if (data.size() <= sizeof(h)) return false;
+        memcpy(&h, data.data(), sizeof(h));
+        if (memcmp(h.magic, bytecodeMagic, sizeof(h.magic)) != 0) return false;
+
+        if (!chunk) {
+            int64_t mtime;
+            uint64_t fileSize;
+            if (!statFile(path, mtime, fileSize) || mtime != h.mtime || fileSize != h.size)
+                return false;
+        }
+        else if (size != h.size || fnv1a(chunk, size) != h.hash) {
+            return false;
+        }
+
+        if (luaL_loadbufferx(L, data.data() + sizeof(h), data.size() - sizeof(h), path.c_str(), "b") != LUA_OK) {
+            lua_pop(L, 1);
+            return false;
+        }
+
+        int64_t mtime;
+        uint64_t fileSize;
+        // only when the chunk is the file as is, a loader that rewrites it never matches.
+        if (chunk && statFile(path, mtime, fileSize) && mtime != h.mtime && fileSize == size) {
+            // windows can't replace a mapped file.
+            data.close();
+            saveCached(path, chunk, size);
+        }
+        return true;
+    }
+
+    // dumps the function on the top of the stack.
+    void LuaMgr::saveCached(const string& path, const char* chunk, size_t size)
+    {
+        if (cacheDir.empty()) return;
+
+        BytecodeHeader h;
+        memcpy(h.magic, bytecodeMagic, sizeof(h.magic));
+        if (!statFile(path, h.mtime, h.size)) h.mtime = 0;
+        h.size = size;
+        h.hash = fnv1a(chunk, size);
+
+        string data((const char*)&h, sizeof(h));
+        if (dumpFunction(L, data))
+            writeFileAtomic(bytecodePath(cacheDir, path), data);
+    }
+
+    struct Module
+    {
+        string name;    // require name
+        string path;    // chunk name, relative to the source root
+        string file;
+        string data;
+    };
+
+    // collects all .lua files under root.
+    static bool listModules(const char* root, std::vector<Module>& modules, string& error)
+    {
+        namespace fs = std::filesystem;
+        std::error_code ec;
+        for (auto it = fs::recursive_directory_iterator(root, ec); !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+            if (!it->is_regular_file() || it->path().extension() != ".lua") continue;
+
+            Module m;
+            m.file = it->path().string();
+            m.path = it->path().lexically_relative(root).generic_string();
+            m.name = m.path.substr(0, m.path.size() - 4);
+            std::replace(m.name.begin(), m.name.end(), '/', '.');
+            modules.push_back(move(m));
+        }
+        if (ec) error = Sprintf("can not read %s: %s", root, ec.message().c_str());
+        return !ec;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // module pack: a header, an index sorted by module name, the name strings
+    // and the concatenated source or bytecode blobs. all in native byte order.
+
+    struct PackHeader
+    {
+        char magic[4];
+        uint32_t version;
+        uint32_t count;
+        uint32_t reserved;
+    };
+
+    struct PackEntry
+    {
+        uint32_t nameOffset, nameSize;  // module name, the lookup key
+        uint32_t pathOffset, pathSize;  // chunk name
+        uint64_t dataOffset, dataSize;
+    };
+
+    static const char packMagic[4] = { 'T', 'L', 'P', 'K' };
+
+    bool LuaMgr::mountPack(const char* packFile)
+    {
+        MappedFile file;
+        if (!file.open(packFile)) {
+            logError(Sprintf("can not mount pack %s: %s", packFile, file.error().c_str()).c_str());
+            return false;
+        }
+        PackHeader h = {};
+        auto valid = file.size() >= sizeof(h);
+        if (valid) {
+            memcpy(&h, file.data(), sizeof(h));
+            valid = memcmp(h.magic, packMagic, sizeof(h.magic)) == 0 && h.version == 1
+                && file.size() >= sizeof(h) + (uint64_t)h.count * sizeof(PackEntry);
+        }
+        auto entries = (const PackEntry*)(file.data() + sizeof(h));
+        for (uint32_t i = 0; valid && i < h.count; i++) {
+            auto& e = entries[i];
+            valid = (uint64_t)e.nameOffset + e.nameSize <= file.size() && (uint64_t)e.pathOffset + e.pathSize <= file.size()
+                && e.dataOffset <= file.size() && e.dataSize <= file.size() - e.dataOffset;
+        }
+        if (!valid) {
+            logError(Sprintf("can not mount pack %s: invalid format", packFile).c_str());
+            return false;
+        }
+        pack = move(file);
+        return true;
+    }
+
+    void LuaMgr::unmountPack()
+    {
+        pack.close();
+    }
+
+    bool LuaMgr::loadPacked(const char* name)
+    {
+        if (!pack.isOpen()) return false;
+
+        auto base = pack.data();
+        auto count = ((const PackHeader*)base)->count;
+        auto begin = (const PackEntry*)(base + sizeof(PackHeader)), end = begin + count;
+        auto nameSize = strlen(name);
+        auto key = [=](const PackEntry& e) { return string_view(base + e.nameOffset, e.nameSize); };
+        auto it = std::lower_bound(begin, end, string_view(name, nameSize), [&](const PackEntry& e, string_view n) { return key(e) < n; });
+        if (it == end || key(*it) != string_view(name, nameSize))
+            return false;
+
+        auto data = base + it->dataOffset;
+        auto size = (size_t)it->dataSize;
+        if (dataChunks && (size == 0 || *data != LUA_SIGNATURE[0]) && loadDataChunk(L, data, size))
+            return true;
+        string chunkName(base + it->pathOffset, it->pathSize);
+        if (luaL_loadbufferx(L, data, size, chunkName.c_str(), "bt") != LUA_OK) {
+            logError(lua_tostring(L, -1));
+            lua_pop(L, 1);
+            return false;
+        }
+        return true;
+    }
+
+    bool LuaMgr::buildPack(const char* srcRoot, const char* packFile, bool compile)
+    {
+        std::vector<Module> modules;
+        string error;
+        if (!listModules(srcRoot, modules, error)) {
+            logError(error.c_str());
+            return false;
+        }
+        auto ok = true;
+        for (auto& m : modules) {
+            m.data = loadFile(m.file.c_str());
+            if (compile) {
+                if (luaL_loadbuffer(L, m.data.data(), m.data.size(), m.path.c_str()) != LUA_OK) {
+                    logError(lua_tostring(L, -1));
+                    lua_pop(L, 1);
+                    ok = false;
+                    continue;
+                }
+                m.data.clear();
+                dumpFunction(L, m.data);
+                lua_pop(L, 1);
+            }
+        }
+        if (!ok) return false;
+
+        std::sort(modules.begin(), modules.end(), [](const Module& a, const Module& b) { return a.name < b.name; });
+
+        PackHeader h = {};
+        memcpy(h.magic, packMagic, sizeof(h.magic));
+        h.version = 1;
+        h.count = (uint32_t)modules.size();
+
+        std::vector<PackEntry> index(modules.size());
+        string names, blobs;
+        auto namesOffset = sizeof(h) + index.size() * sizeof(PackEntry);
+        for (size_t i = 0; i < modules.size(); i++) {
+            auto& m = modules[i];
+            auto& e = index[i];
+            e.nameOffset = (uint32_t)(namesOffset + names.size());
+            e.nameSize = (uint32_t)m.name.size();
+            names += m.name;
+            e.pathOffset = (uint32_t)(namesOffset + names.size());
+            e.pathSize = (uint32_t)m.path.size();
+            names += m.path;
+        }
+        auto blobsOffset = namesOffset + names.size();
+        for (size_t i = 0; i < modules.size(); i++) {
+            index[i].dataOffset = blobsOffset + blobs.size();
+            index[i].dataSize = modules[i].data.size();
+            blobs += modules[i].data;
+        }
+
+        string data((const char*)&h, sizeof(h));
+        data.append((const char*)index.data(), index.size() * sizeof(PackEntry));
+        data += names;
+        data += blobs;
+        if (!writeFileAtomic(packFile, data)) {
+            logError(Sprintf("can not write pack %s", packFile).c_str());
+            return false;
+        }
+        return true;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // in-memory precompiled modules
+
+    int LuaMgr::precompile(const char* rootDir, int threads)
+    {
+        std::vector<Module> modules;
+        string error;
+        if (!listModules(rootDir, modules, error)) {
+            logError(error.c_str());
+            return -1;
+        }
+
+        // workers only touch their own scratch state, never the shared LuaObj::L.
+        std::vector<string> errors(modules.size());
+        std::atomic<size_t> next{ 0 };
+        // nothing may escape a worker, an exception leaving a thread terminates.
+        auto work = [&] {
+            auto S = luaL_newstate();
+            for (size_t i; (i = next++) < modules.size();) {
+                auto& m = modules[i];
+                if (!S) {
+                    errors[i] = "can not create a Lua state to compile " + m.file;
+                    continue;
+                }
+                try {
+                    MappedFile file;
+                    if (!file.open(m.file.c_str()))
+                        errors[i] = Sprintf("can not get file data of %s: %s", m.file.c_str(), file.error().c_str());
+                    else if (luaL_loadbuffer(S, file.data(), file.size(), m.path.c_str()) != LUA_OK)
+                        errors[i] = lua_tostring(S, -1);
+                    else if (!dumpFunction(S, m.data))
+                        errors[i] = "can not dump the bytecode of " + m.file;
+                }
+                catch (std::exception& e) {
+                    errors[i] = m.file + ": " + e.what();
+                }
+                lua_settop(S, 0);
+            }
+            if (S) lua_close(S);
+        };
+
+        if (threads <= 0) threads = std::max(1, (int)std::thread::hardware_concurrency());
+        threads = std::min(threads, std::max(1, (int)modules.size()));
+        std::vector<std::thread> pool;
+        for (int i = 1; i < threads; i++) pool.push_back(helperThread(work));
+        work();
+        for (auto& t : pool) t.join();
+
+        int failed = 0;
+        for (size_t i = 0; i < modules.size(); i++) {
+            if (!errors[i].empty()) {
+                logError(errors[i].c_str());
+                failed++;
+                continue;
+            }
+            auto& m = modules[i];
+            precompiled[m.name] = { move(m.path), move(m.data) };
+        }
+        return failed;
+    }
+
+    void LuaMgr::clearPrecompiled()
+    {
+        precompiled.clear();
+    }
+
+    bool LuaMgr::loadPrecompiled(const char* name)
+    {
+        auto it = precompiled.find(name);
+        if (it == precompiled.end()) return false;
+
+        auto& m = it->second;
+        if (luaL_loadbufferx(L, m.second.data(), m.second.size(), m.first.c_str(), "b") != LUA_OK) {
+            logError(lua_tostring(L, -1));
+            lua_pop(L, 1);
+            return false;
+        }
+        return true;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // prefork
+
+#ifndef _WIN32
+
+    std::vector<int> LuaMgr::prefork(int workers, function<int(int)> workerMain)
+    {
+        // settle the heap so the children start from compact, shared pages.
+        lua_gc(L, LUA_GCCOLLECT, 0);
+        lua_gc(L, LUA_GCCOLLECT, 0);
+        fflush(nullptr);
+        auto restart = pauseThreads();
+
+        std::vector<int> pids;
+        for (int i = 0; i < workers; i++) {
+            auto pid = fork();
+            if (pid < 0) {
+                logError(Sprintf("fork failed: %s", strerror(errno)).c_str());
+                break;
+            }
+            if (pid == 0) {
+                // the parent's rng state is inherited as well.
+                auto seed = (unsigned)time(nullptr) ^ ((unsigned)getpid() << 16);
+                srand(seed);
+                // math may not be opened at all.
+                auto top = lua_gettop(L);
+                if (lua_getglobal(L, "math") == LUA_TTABLE && lua_getfield(L, -1, "randomseed") == LUA_TFUNCTION) {
+                    lua_pushinteger(L, seed);
+                    lua_pcall(L, 1, 0, 0);
+                }
+                lua_settop(L, top);
+
+                restart();
+                for (auto& hook : afterFork) hook(i);
+                auto ret = workerMain ? workerMain(i) : 0;
+                fflush(nullptr);
+                _exit(ret);
+            }
+            pids.push_back(pid);
+        }
+        restart();
+        return pids;
+    }
+
+    long LuaMgr::dirtyPages(int pid)
+    {
+        auto path = pid ? Sprintf("/proc/%d/smaps_rollup", pid) : string("/proc/self/smaps_rollup");
+        auto f = fopen(path.c_str(), "r");
+        if (!f) {
+            path = pid ? Sprintf("/proc/%d/smaps", pid) : string("/proc/self/smaps");
+            f = fopen(path.c_str(), "r");
+        }
+        if (!f) return -1;
+
+        char line[256];
+        long kb = 0, v;
+        while (fgets(line, sizeof(line), f)) {
+            if (sscanf(line, "Private_Dirty: %ld kB", &v) == 1) kb += v;
+        }
+        fclose(f);
+        return kb * 1024 / sysconf(_SC_PAGESIZE);
+    }
+
+#else
+
+    std::vector<int> LuaMgr::prefork(int workers, function<int(int)> workerMain)
+    {
+        logError("prefork is not supported on this platform");
+        return {};
+    }
+
+    long LuaMgr::dirtyPages(int pid)
+    {
+        return -1;
+    }
+
+#endif
+
+    //////////////////////////////////////////////////////////////////////////
+    // sampling profiler
+
+    // a count hook makes the VM trace every instruction, so the timer only arms it for
+    // the next instruction and the hook goes back to the base hook after the sample.
+    // lua_sethook is safe to call from a signal handler.
+    volatile sig_atomic_t ProfileTick::pending = 0;
+    static volatile sig_atomic_t baseHookMask = 0, baseHookCount = 0;
+    // the mask of the hooks on the main state, ours and a foreign one, for the one-shot
+    // to keep. only the VM thread writes it, see LuaMgr::armHook.
+    static volatile sig_atomic_t armHookMask = 0;
+    // coroutines being resumed while the thread hook is on, innermost last.
+    static vector<lua_State*> resumedThreads;
+    // a tool wants the thread hook, which stays on until the resumes it saw return.
+    static bool threadHookWanted = false;
+
+    // the thread running Lua code, as far as the thread hook knows.
+    static lua_State* runningThread()
+    {
+        return resumedThreads.empty() ? LuaObj::L : resumedThreads.back();
+    }
+
+    // the bound call the timer fired in, as the hook only runs in Lua code.
+    static const void* profileCFunc = nullptr;
+
+    void ProfileTick::inBinding(lua_State* L)
+    {
+        if (!profileCFunc) profileCFunc = runningCFuncKey(L);
+    }
+
+    struct LuaMgr::Profiler
+    {
+        struct Frame
+        {
+            string shortSrc;
+            int id;
+        };
+
+        bool running = false;
+        int hz = 0;
+        size_t samples = 0;
+        vector<string> labels;
+        unordered_map<string, int> labelIds;
+        unordered_map<const void*, string> libNames;
+        // Lua functions by (source, linedefined), checked against short_src in case a
+        // collected chunk's source is reused.
+        map<pair<const char*, int>, Frame> luaFrames;
+        map<vector<int>, size_t> stacks; // frame ids root first -> samples
+        vector<int> stack;
+#ifdef _WIN32
+        std::thread ticker;
+        std::atomic<bool> ticking{ false };
+#else
+        struct sigaction oldAction;
+#endif
+
+        static void arm()
+        {
+            auto L = LuaObj::L;
+            if (!L) return;
+            ProfileTick::pending = 1;
+            armHook(L);
+        }
+
+        // standard library functions by their global names, found once per start.
+        void nameLibFuncs(lua_State* L)
+        {
+            auto add = [&](const string& prefix) {
+                lua_pushnil(L);
+                while (lua_next(L, -2)) {
+                    if (lua_type(L, -2) == LUA_TSTRING && lua_iscfunction(L, -1))
+                        libNames.emplace(cFuncKey(L, -1), prefix + lua_tostring(L, -2));
+                    lua_pop(L, 1);
+                }
+            };
+            lua_pushglobaltable(L);
+            add("");
+            lua_pushnil(L);
+            while (lua_next(L, -2)) {
+                if (lua_type(L, -2) == LUA_TSTRING && lua_istable(L, -1) && !lua_rawequal(L, -1, -3))
+                    add(string(lua_tostring(L, -2)) + ".");
+                lua_pop(L, 1);
+            }
+            lua_pop(L, 1);
+        }
+
+        const string* cFuncName(const void* f)
+        {
+            auto it = instance->funcNames.find(f);
+            if (it != instance->funcNames.end()) return &it->second;
+            it = libNames.find(f);
+            return it != libNames.end() ? &it->second : nullptr;
+        }
+
+        int cFuncId(const void* f)
+        {
+            auto name = cFuncName(f);
+            return labelId(name ? *name : "[C]");
+        }
+
+        int labelId(string label)
+        {
+            // ';' separates frames in the folded output.
+            std::replace(label.begin(), label.end(), ';', ',');
+            auto it = labelIds.find(label);
+            if (it != labelIds.end()) return it->second;
+            labels.push_back(label);
+            return labelIds[label] = (int)labels.size() - 1;
+        }
+
+        int frameId(lua_State* L, lua_Debug& ar)
+        {
+            if (*ar.what == 'C') {
+                lua_getinfo(L, "f", &ar);
+                auto f = cFuncKey(L, -1);
+                lua_pop(L, 1);
+                if (auto name = f ? cFuncName(f) : nullptr) return labelId(*name);
+                lua_getinfo(L, "n", &ar);
+                return labelId(ar.name ? string(ar.name) + " [C]" : "? [C]");
+            }
+
+            auto& frame = luaFrames[{ ar.source, ar.linedefined }];
+            if (frame.shortSrc.empty() || frame.shortSrc != ar.short_src) {
+                lua_getinfo(L, "n", &ar);
+                auto where = Sprintf("%s:%d", ar.short_src, ar.linedefined);
+                if (*ar.what == 'm')
+                    frame.id = labelId("main " + where);
+                else
+                    frame.id = labelId(ar.name ? string(ar.name) + " " + where : where);
+                frame.shortSrc = ar.short_src;
+            }
+            return frame.id;
+        }
+
+        void sample(lua_State* L)
+        {
+            lua_Debug ar;
+            stack.clear();
+            for (int level = 0; lua_getstack(L, level, &ar); level++) {
+                lua_getinfo(L, "S", &ar);
+                stack.push_back(frameId(L, ar));
+            }
+            std::reverse(stack.begin(), stack.end());
+            // time in a bound call that returned before the hook ran is its own leaf.
+            if (auto f = profileCFunc) {
+                profileCFunc = nullptr;
+                auto id = cFuncId(f);
+                if (std::find(stack.begin(), stack.end(), id) == stack.end()) stack.push_back(id);
+            }
+            stacks[stack]++;
+            samples++;
+        }
+    };
+
+    bool LuaMgr::startProfiler(int hz /*= 1000*/)
+    {
+        stopProfiler();
+        if (hz <= 0) return false;
+        if (!profiler) profiler.reset(new Profiler());
+        auto& p = *profiler;
+        p.nameLibFuncs(L);
+        updateHook();
+        auto us = std::max(1000000 / hz, 1);
+#ifdef _WIN32
+        p.ticking = true;
+        p.ticker = helperThread([&p, us] {
+            while (p.ticking) {
+                std::this_thread::sleep_for(std::chrono::microseconds(us));
+                if (p.ticking) Profiler::arm();
+            }
+        });
+#else
+        struct sigaction sa = {};
+        sa.sa_handler = [](int) { Profiler::arm(); };
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(SIGPROF, &sa, &p.oldAction) != 0) {
+            logError(Sprintf("profiler: sigaction failed: %s", strerror(errno)).c_str());
+            return false;
+        }
+        itimerval timer = {};
+        timer.it_interval.tv_sec = us / 1000000;
+        timer.it_interval.tv_usec = us % 1000000;
+        timer.it_value = timer.it_interval;
+        if (setitimer(ITIMER_PROF, &timer, nullptr) != 0) {
+            logError(Sprintf("profiler: setitimer failed: %s", strerror(errno)).c_str());
+            sigaction(SIGPROF, &p.oldAction, nullptr);
+            return false;
+        }
+#endif
+        p.running = true;
+        p.hz = hz;
+        return true;
+    }
+
+    void LuaMgr::stopProfiler()
+    {
+        if (!profiler || !profiler->running) return;
+        auto& p = *profiler;
+#ifdef _WIN32
+        p.ticking = false;
+        p.ticker.join();
+#else
+        itimerval timer = {};
+        setitimer(ITIMER_PROF, &timer, nullptr);
+        sigaction(SIGPROF, &p.oldAction, nullptr);
+#endif
+        p.running = false;
+        ProfileTick::pending = 0;
+        profileCFunc = nullptr;
+        updateHook();
+    }
+
+    void LuaMgr::clearProfile()
+    {
+        if (!profiler) return;
+        profiler->samples = 0;
+        profiler->stacks.clear();
+    }
+
+    string LuaMgr::profileFolded() const
+    {
+        string out;
+        if (!profiler) return out;
+        auto& p = *profiler;
+        for (auto& s : p.stacks) {
+            for (size_t i = 0; i < s.first.size(); i++) {
+                if (i) out += ';';
+                out += p.labels[s.first[i]];
+            }
+            out += Sprintf(" %zu\n", s.second);
+        }
+        return out;
+    }
+
+    string LuaMgr::profileTop(int n /*= 20*/) const
+    {
+        if (!profiler || !profiler->samples) return "no samples\n";
+        auto& p = *profiler;
+
+        // self counts the leaf frame, total every function on the stack once.
+        vector<size_t> self(p.labels.size()), total(p.labels.size()), seen(p.labels.size());
+        size_t mark = 0;
+        for (auto& s : p.stacks) {
+            if (s.first.empty()) continue;
+            mark++;
+            self[s.first.back()] += s.second;
+            for (auto id : s.first) {
+                if (seen[id] == mark) continue;
+                seen[id] = mark;
+                total[id] += s.second;
+            }
+        }
+
+        vector<int> order;
+        for (int i = 0; i < (int)self.size(); i++) if (total[i]) order.push_back(i);
+        std::sort(order.begin(), order.end(), [&](int a, int b) {
+            return self[a] != self[b] ? self[a] > self[b] : total[a] > total[b];
+        });
+        if (n >= 0 && (int)order.size() > n) order.resize(n);
+
+        auto out = Sprintf("%zu samples at %d Hz\n%7s %7s  %s\n", p.samples, p.hz, "self%", "total%", "function");
+        for (auto i : order) {
+            out += Sprintf("%6.2f%% %6.2f%%  %s\n", 100.0 * self[i] / p.samples, 100.0 * total[i] / p.samples, p.labels[i].c_str());
+        }
+        return out;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // allocation-site memory profiler
+
+    struct LuaMgr::MemoryProfiler
+    {
+        struct Block
+        {
+            int site;
+            int64_t bytes, count; // what the sample stands for
+        };
+
+        lua_Alloc alloc;
+        void* ud;
+        size_t sampleBytes;
+        int64_t untilSample = 0;
+        int64_t allocated = 0, allocations = 0; // exact, since start
+        std::mt19937_64 rng{ 0x9e3779b97f4a7c15ull };
+        unordered_map<void*, Block> blocks; // sampled and still live
+        MemorySnapshot sites;
+        unordered_map<string, int> siteIds;
+
+        // randomized so periodic allocation patterns don't alias with the interval.
+        void nextSample()
+        {
+            std::exponential_distribution<double> d(1.0 / sampleBytes);
+            untilSample += (int64_t)d(rng) + 1;
+        }
+
+        int siteId(bool stackMoving)
+        {
+            // only reads the stack, nothing here may allocate from the Lua state. the
+            // stack itself can't be read while it is being reallocated.
+            auto L = runningThread();
+            lua_Debug ar;
+            char buf[2 * LUA_IDSIZE + 64]; // short_src is at most LUA_IDSIZE, twice for a function
+            auto found = false;
+            for (int level = 0; !stackMoving && lua_getstack(L, level, &ar); level++) {
+                lua_getinfo(L, "Sl", &ar);
+                if (ar.currentline < 0) continue;
+                lua_getinfo(L, "n", &ar);
+                if (*ar.what == 'm')
+                    snprintf(buf, sizeof(buf), "%s:%d in main chunk", ar.short_src, ar.currentline);
+                else if (ar.name)
+                    snprintf(buf, sizeof(buf), "%s:%d in %.48s", ar.short_src, ar.currentline, ar.name);
+                else
+                    snprintf(buf, sizeof(buf), "%s:%d in function <%s:%d>", ar.short_src, ar.currentline, ar.short_src, ar.linedefined);
+                found = true;
+                break;
+            }
+            string key = found ? buf : stackMoving ? "[stack]" : "[host]";
+            auto it = siteIds.find(key);
+            if (it != siteIds.end()) return it->second;
+            sites.push_back({ key });
+            return siteIds[key] = (int)sites.size() - 1;
+        }
+
+        void release(void* ptr)
+        {
+            auto it = blocks.find(ptr);
+            if (it == blocks.end()) return;
+            auto& site = sites[it->second.site];
+            site.liveBytes -= it->second.bytes;
+            site.liveCount -= it->second.count;
+            blocks.erase(it);
+        }
+
+        void record(void* ptr, size_t size, bool stackMoving)
+        {
+            allocated += size;
+            allocations++;
+            if (sampleBytes > 1) {
+                untilSample -= size;
+                if (untilSample > 0) return;
+                nextSample();
+            }
+            // a sample stands for sampleBytes bytes, or itself when bigger.
+            auto bytes = std::max<int64_t>(size, sampleBytes);
+            auto count = std::max<int64_t>(bytes / std::max<size_t>(size, 1), 1);
+            auto id = siteId(stackMoving);
+            auto& site = sites[id];
+            site.liveBytes += bytes;
+            site.liveCount += count;
+            site.totalBytes += bytes;
+            site.totalCount += count;
+            blocks[ptr] = { id, bytes, count };
+        }
+
+        static void* allocf(void* ud, void* ptr, size_t osize, size_t nsize)
+        {
+            auto& p = *(MemoryProfiler*)ud;
+            if (ptr && !p.blocks.empty()) p.release(ptr);
+            auto r = p.alloc(p.ud, ptr, osize, nsize);
+            if (r && nsize) p.record(r, nsize, ptr && ptr == runningThread()->stack);
+            return r;
+        }
+    };
+
+    bool LuaMgr::startMemoryProfiler(size_t sampleBytes /*= 0*/)
+    {
+        stopMemoryProfiler();
+        memoryProfiler.reset(new MemoryProfiler());
+        auto& p = *memoryProfiler;
+        p.alloc = lua_getallocf(L, &p.ud);
+        p.sampleBytes = sampleBytes;
+        if (sampleBytes > 1) p.nextSample();
+        lua_setallocf(L, MemoryProfiler::allocf, &p);
+        updateThreadHook();
+        return true;
+    }
+
+    void LuaMgr::innerAlloc(lua_Alloc* f, void** ud) const
+    {
+        if (memoryProfiler && memoryProfiler->alloc) {
+            *f = memoryProfiler->alloc;
+            *ud = memoryProfiler->ud;
+        }
+        else
+            *f = lua_getallocf(L, ud);
+    }
+
+    void LuaMgr::setInnerAlloc(lua_Alloc f, void* ud)
+    {
+        if (memoryProfiler && memoryProfiler->alloc) {
+            memoryProfiler->alloc = f;
+            memoryProfiler->ud = ud;
+        }
+        else
+            lua_setallocf(L, f, ud);
+    }
+
+    void LuaMgr::stopMemoryProfiler()
+    {
+        // the results stay readable until the next start.
+        if (!memoryProfiler || !memoryProfiler->alloc) return;
+        auto& p = *memoryProfiler;
+        lua_setallocf(L, p.alloc, p.ud);
+        p.alloc = nullptr;
+        p.blocks.clear();
+        updateThreadHook();
+    }
+
+    LuaMgr::MemorySnapshot LuaMgr::memorySnapshot() const
+    {
+        if (!memoryProfiler) return {};
+        auto v = memoryProfiler->sites;
+        std::sort(v.begin(), v.end(), [](const MemorySite& a, const MemorySite& b) {
+            return a.liveBytes != b.liveBytes ? a.liveBytes > b.liveBytes : a.totalBytes > b.totalBytes;
+        });
+        return v;
+    }
+
+    string LuaMgr::memoryReport(int n /*= 20*/) const
+    {
+        if (!memoryProfiler) return "memory profiler not started\n";
+        auto& p = *memoryProfiler;
+        auto v = memorySnapshot();
+        if (n >= 0 && (int)v.size() > n) v.resize(n);
+
+        auto out = Sprintf("%lld allocations, %lld bytes since start, %d KB in use\n",
+            (long long)p.allocations, (long long)p.allocated, lua_gc(L, LUA_GCCOUNT, 0));
+        out += Sprintf("%12s %10s %14s %10s  %s\n", "live bytes", "live", "total bytes", "total", "site");
+        for (auto& s : v) {
+            out += Sprintf("%12lld %10lld %14lld %10lld  ", (long long)s.liveBytes, (long long)s.liveCount,
+                (long long)s.totalBytes, (long long)s.totalCount);
+            out += s.site + "\n";
+        }
+        return out;
+    }
+
+    string LuaMgr::memoryDiff(const MemorySnapshot& before, const MemorySnapshot& after, int n /*= 20*/)
+    {
+        unordered_map<string, const MemorySite*> old;
+        for (auto& s : before) old[s.site] = &s;
+
+        struct Delta { const string* site; int64_t bytes, count; };
+        vector<Delta> v;
+        for (auto& s : after) {
+            auto it = old.find(s.site);
+            auto bytes = s.liveBytes - (it != old.end() ? it->second->liveBytes : 0);
+            auto count = s.liveCount - (it != old.end() ? it->second->liveCount : 0);
+            if (bytes || count) v.push_back({ &s.site, bytes, count });
+        }
+        std::sort(v.begin(), v.end(), [](const Delta& a, const Delta& b) { return a.bytes > b.bytes; });
+        if (n >= 0 && (int)v.size() > n) v.resize(n);
+
+        auto out = Sprintf("%12s %10s  %s\n", "+live bytes", "+live", "site");
+        for (auto& d : v) {
+            out += Sprintf("%+12lld %+10lld  ", (long long)d.bytes, (long long)d.count);
+            out += *d.site + "\n";
+        }
+        return out;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // heap snapshot. a text file, one record per line:
+    //   tlua-heap 1
+    //   N <id> <type> <size> <name>    ids count from 1, in the order found
+    //   E <from> <to> <label>
+    //   R <id> <label>                 the registry and the main thread
+
+    struct HeapWalker
+    {
+        lua_State* L;
+        const unordered_map<const void*, string>& funcNames;
+        int queue = 0; // stack index of the table holding the values to visit
+        int queued = 0;
+        int base = 0; // top of the walk: the walker, then the host's stack values
+        unordered_map<const void*, int> ids;
+        string out;
+
+        HeapWalker(lua_State* L, const unordered_map<const void*, string>& funcNames)
+            : L(L), funcNames(funcNames)
+        {}
+
+        static string clean(const char* s, size_t len)
+        {
+            string r(s, std::min<size_t>(len, 60));
+            for (auto& c : r) if ((unsigned char)c < 0x20) c = '?';
+            return len > r.size() ? r + "..." : r;
+        }
+
+        string label(int idx)
+        {
+            switch (lua_type(L, idx)) {
+            case LUA_TSTRING: {
+                size_t len;
+                auto s = lua_tolstring(L, idx, &len);
+                return clean(s, len);
+            }
+            case LUA_TNUMBER:
+                return lua_isinteger(L, idx) ? Sprintf("[%lld]", (long long)lua_tointeger(L, idx)) : Sprintf("[%g]", lua_tonumber(L, idx));
+            case LUA_TBOOLEAN:
+                return lua_toboolean(L, idx) ? "[true]" : "[false]";
+            default:
+                return string("[") + luaL_typename(L, idx) + "]";
+            }
+        }
+
+        string name(int idx)
+        {
+            idx = lua_absindex(L, idx);
+            switch (lua_type(L, idx)) {
+            case LUA_TSTRING:
+                return label(idx);
+            case LUA_TFUNCTION: {
+                if (lua_iscfunction(L, idx)) {
+                    auto it = funcNames.find(cFuncKey(L, idx));
+                    return it != funcNames.end() ? it->second : "[C]";
+                }
+                lua_Debug ar;
+                lua_pushvalue(L, idx);
+                lua_getinfo(L, ">S", &ar);
+                return Sprintf("%s:%d", ar.short_src, ar.linedefined);
+            }
+            case LUA_TUSERDATA: {
+                // instances of bound types have the class table, which knows its name.
+                string r;
+                if (lua_getmetatable(L, idx)) {
+                    lua_pushliteral(L, "_name");
+                    if (lua_rawget(L, -2) == LUA_TSTRING) r = lua_tostring(L, -1);
+                    lua_pop(L, 2);
+                }
+                return r;
+            }
+            case LUA_TTHREAD:
+                return lua_tothread(L, idx) == L ? "main" : "coroutine";
+            }
+            return "";
+        }
+
+        size_t size(int idx, int type, const void* p, size_t len)
+        {
+            switch (type) {
+            case LUA_TTABLE: {
+                auto t = (const Table*)p;
+                return sizeof(Table) + t->sizearray * sizeof(TValue) + (t->lastfree ? sizeof(Node) << t->lsizenode : 0);
+            }
+            case LUA_TFUNCTION: {
+                // a C function without upvalues is no object at all.
+                size_t n = 0;
+                while (lua_getupvalue(L, idx, (int)n + 1)) {
+                    lua_pop(L, 1);
+                    n++;
+                }
+                if (!lua_iscfunction(L, idx)) return sizeof(LClosure) + (n ? n - 1 : 0) * sizeof(UpVal*);
+                return n ? sizeof(CClosure) + (n - 1) * sizeof(TValue) : 0;
+            }
+            case LUA_TSTRING:
+                return sizeof(UTString) + len + 1;
+            case LUA_TUSERDATA:
+                return sizeof(UUdata) + len;
+            case LUA_TTHREAD: {
+                auto co = (const lua_State*)p;
+                return sizeof(lua_State) + co->stacksize * sizeof(TValue) + co->nci * sizeof(CallInfo);
+            }
+            }
+            return 0;
+        }
+
+        int add(const void* key, const char* type, size_t size, const string& name)
+        {
+            auto id = (int)ids.size() + 1;
+            ids[key] = id;
+            out += Sprintf("N %d %s %zu ", id, type, size) + name + "\n";
+            return id;
+        }
+
+        // id of the value at idx, queueing it when first seen. 0 for values that aren't
+        // objects, and for the walker's own queue.
+        int node(int idx)
+        {
+            idx = lua_absindex(L, idx);
+            auto type = lua_type(L, idx);
+            size_t len = 0;
+            const void* p = nullptr;
+            if (type == LUA_TSTRING) p = lua_tolstring(L, idx, &len);
+            else if (type == LUA_TTABLE || type == LUA_TFUNCTION || type == LUA_TUSERDATA || type == LUA_TTHREAD) p = lua_topointer(L, idx);
+            if (!p || p == lua_topointer(L, queue)) return 0;
+
+            auto it = ids.find(p);
+            if (it != ids.end()) return it->second;
+            if (type == LUA_TUSERDATA) len = lua_rawlen(L, idx);
+            auto id = add(p, lua_typename(L, type), size(idx, type, p, len), name(idx));
+            if (type != LUA_TSTRING) {
+                lua_pushvalue(L, idx);
+                lua_rawseti(L, queue, ++queued);
+            }
+            return id;
+        }
+
+        void edge(int from, int to, const string& label)
+        {
+            if (to) out += Sprintf("E %d %d ", from, to) + label + "\n";
+        }
+
+        // edge to the value on top of the stack, which it pops.
+        void edge(int from, const string& label)
+        {
+            edge(from, node(-1), label);
+            lua_pop(L, 1);
+        }
+
+        void visit(int id)
+        {
+            auto v = lua_gettop(L);
+            switch (lua_type(L, v)) {
+            case LUA_TTABLE: {
+                auto weakKeys = false, weakValues = false;
+                if (lua_getmetatable(L, v)) {
+                    lua_pushliteral(L, "__mode");
+                    if (lua_rawget(L, -2) == LUA_TSTRING) {
+                        weakKeys = strchr(lua_tostring(L, -1), 'k') != nullptr;
+                        weakValues = strchr(lua_tostring(L, -1), 'v') != nullptr;
+                    }
+                    lua_pop(L, 1);
+                    edge(id, "[metatable]");
+                }
+                lua_pushnil(L);
+                while (lua_next(L, v)) {
+                    auto key = label(-2);
+                    if (id == 1 && lua_isinteger(L, -2) && lua_tointeger(L, -2) == LUA_RIDX_GLOBALS) key = "_G"; // in the registry
+                    if (!weakKeys)
+                        edge(id, node(-2), "[key] " + key);
+                    if (!weakValues)
+                        edge(id, node(-1), key);
+                    lua_pop(L, 1);
+                }
+                break;
+            }
+            case LUA_TFUNCTION: {
+                if (lua_iscfunction(L, v)) {
+                    for (int i = 1; lua_getupvalue(L, v, i); i++) edge(id, Sprintf("[upvalue %d]", i));
+                    break;
+                }
+                auto p = ((const LClosure*)lua_topointer(L, v))->p;
+                auto it = ids.find(p);
+                if (it == ids.end()) {
+                    auto bytes = sizeof(Proto) + p->sizecode * sizeof(Instruction) + p->sizep * sizeof(Proto*) + p->sizek * sizeof(TValue)
+                        + p->sizelineinfo * sizeof(int) + p->sizelocvars * sizeof(LocVar) + p->sizeupvalues * sizeof(Upvaldesc)
+                        + (p->hits ? p->sizecode * sizeof(lua_Unsigned) : 0);
+                    add(p, "proto", bytes, name(v));
+                    it = ids.find(p);
+                }
+                edge(id, it->second, "[proto]");
+                for (int i = 1; auto upName = lua_getupvalue(L, v, i); i++) {
+                    // upvalues are shared between closures, so they are nodes of their own.
+                    auto uv = lua_upvalueid(L, v, i);
+                    auto u = ids.find(uv);
+                    if (u == ids.end()) {
+                        auto uid = add(uv, "upvalue", sizeof(UpVal), upName);
+                        edge(uid, "value");
+                        u = ids.find(uv);
+                    }
+                    else {
+                        lua_pop(L, 1);
+                    }
+                    edge(id, u->second, upName);
+                }
+                break;
+            }
+            case LUA_TUSERDATA:
+                if (lua_getmetatable(L, v)) edge(id, "[metatable]");
+                lua_getuservalue(L, v);
+                edge(id, "[uservalue]");
+                break;
+            case LUA_TTHREAD: {
+                auto co = lua_tothread(L, v);
+                lua_Debug ar;
+                // level 0 of the main state is the walk itself.
+                int first = co == L ? 1 : 0, level = first;
+                for (; lua_getstack(co, level, &ar); level++) {
+                    if (co != L && !lua_checkstack(co, 1)) break;
+                    for (int n = 1; auto local = lua_getlocal(co, &ar, n); n++) {
+                        if (co != L) lua_xmove(co, L, 1);
+                        edge(id, Sprintf("[%d] ", level - first) + local);
+                    }
+                }
+                // not started yet, or the host's values when nothing runs, which the
+                // walk got after itself.
+                auto top = co == L ? base - 1 : lua_gettop(co);
+                for (int i = 1; level == first && i <= top; i++) {
+                    if (co == L) lua_pushvalue(L, i + 1);
+                    else {
+                        lua_pushvalue(co, i);
+                        lua_xmove(co, L, 1);
+                    }
+                    edge(id, Sprintf("[stack %d]", i));
+                }
+                break;
+            }
+            }
+        }
+
+        // run under lua_pcall with the walker, then the host's stack values.
+        static int walk(lua_State* L)
+        {
+            auto w = (HeapWalker*)lua_touserdata(L, 1);
+            w->walk();
+            return 0;
+        }
+
+        void walk()
+        {
+            base = lua_gettop(L);
+            luaL_checkstack(L, 16, "heap snapshot");
+            lua_newtable(L);
+            queue = lua_gettop(L);
+            lua_pushvalue(L, LUA_REGISTRYINDEX);
+            out += Sprintf("R %d registry\n", node(-1));
+            lua_pop(L, 1);
+            lua_pushthread(L);
+            out += Sprintf("R %d main\n", node(-1));
+            lua_pop(L, 1);
+            for (int i = 1; i <= queued; i++) {
+                lua_rawgeti(L, queue, i);
+                visit(ids[lua_type(L, -1) == LUA_TSTRING ? lua_tostring(L, -1) : lua_topointer(L, -1)]);
+                lua_settop(L, queue);
+            }
+            lua_settop(L, base);
+        }
+    };
+
+    bool LuaMgr::heapSnapshot(const char* path)
+    {
+        // nothing may be collected, nor addresses reused, while ids are handed out.
+        GcPause pause(L);
+        HeapWalker w(L, funcNames);
+        w.out = "tlua-heap 1\n";
+        // the walk raises memory errors, a memory limit's too.
+        auto top = lua_gettop(L);
+        if (!lua_checkstack(L, top + 2)) {
+            logError("can not take heap snapshot: stack overflow");
+            return false;
+        }
+        lua_pushcfunction(L, HeapWalker::walk);
+        lua_pushlightuserdata(L, &w);
+        for (int i = 1; i <= top; i++) lua_pushvalue(L, i);
+        if (lua_pcall(L, top + 1, 0, 0) != LUA_OK) {
+            logError(Sprintf("can not take heap snapshot: %s", lua_tostring(L, -1)).c_str());
+            lua_pop(L, 1);
+            return false;
+        }
+        if (!writeFileAtomic(path, w.out)) {
+            logError(Sprintf("can not write heap snapshot: %s", path).c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // a snapshot read back, with the retained size of every object and a key for its
+    // path from the roots (the breadth-first one) to match objects across snapshots.
+    struct HeapGraph
+    {
+        struct Node
+        {
+            string type, name, label;
+            uint64_t size = 0, retained = 0;
+            uint64_t key = 0;
+            int parent = -1, depth = 0;
+        };
+        vector<Node> nodes; // [0] stands above the roots
+        vector<int> edgeStart, edgeTo; // edges by source, in file order
+        vector<string> edgeLabel;
+
+        bool load(const string& text)
+        {
+            if (text.compare(0, 11, "tlua-heap 1") != 0) return false;
+            nodes.resize(1);
+            struct Edge { int from, to; string label; };
+            vector<Edge> edges;
+            for (size_t pos = 0; pos < text.size();) {
+                auto end = text.find('\n', pos);
+                if (end == string::npos) end = text.size();
+                // sscanf would measure the whole rest of the text on every call.
+                string record(text, pos, end - pos);
+                auto line = record.c_str();
+                int from = 0, to = 0, n = 0;
+                unsigned long long size = 0;
+                char type[16];
+                // %n after the last field, a trailing space would skip over an empty name.
+                auto rest = [&]() { return string(line + n + (line[n] == ' ')); };
+                if (sscanf(line, "N %d %15s %llu%n", &to, type, &size, &n) == 3 && n && to > 0) {
+                    if ((int)nodes.size() <= to) nodes.resize(to + 1);
+                    nodes[to].type = type;
+                    nodes[to].size = size;
+                    nodes[to].name = rest();
+                }
+                else if (sscanf(line, "E %d %d%n", &from, &to, &n) == 2 && n) {
+                    edges.push_back({ from, to, rest() });
+                }
+                else if (sscanf(line, "R %d%n", &to, &n) == 1 && n) {
+                    edges.push_back({ 0, to, rest() });
+                }
+                pos = end + 1;
+            }
+
+            std::stable_sort(edges.begin(), edges.end(), [](const Edge& a, const Edge& b) { return a.from < b.from; });
+            edgeStart.assign(nodes.size() + 1, 0);
+            for (auto& e : edges) {
+                if (e.from < 0 || e.to <= 0 || e.from >= (int)nodes.size() || e.to >= (int)nodes.size()) return false;
+                edgeStart[e.from + 1]++;
+                edgeTo.push_back(e.to);
+                edgeLabel.push_back(std::move(e.label));
+            }
+            for (size_t i = 1; i < edgeStart.size(); i++) edgeStart[i] += edgeStart[i - 1];
+            paths();
+            retain();
+            return true;
+        }
+
+        void paths()
+        {
+            vector<int> queue{ 0 };
+            nodes[0].parent = 0;
+            for (size_t i = 0; i < queue.size(); i++) {
+                auto v = queue[i];
+                for (auto e = edgeStart[v]; e < edgeStart[v + 1]; e++) {
+                    auto& n = nodes[edgeTo[e]];
+                    if (n.parent >= 0) continue;
+                    n.parent = v;
+                    n.depth = nodes[v].depth + 1;
+                    n.label = edgeLabel[e];
+                    auto key = Sprintf("%016llx.", (unsigned long long)nodes[v].key) + n.label;
+                    n.key = fnv1a(key.data(), key.size());
+                    queue.push_back(edgeTo[e]);
+                }
+            }
+        }
+
+        // retained sizes from the dominator tree (Cooper, Harvey and Kennedy's iteration).
+        void retain()
+        {
+            auto count = (int)nodes.size();
+            vector<int> order, post(count, -1); // reverse postorder, postorder numbers
+            vector<std::pair<int, int>> stack{ { 0, edgeStart[0] } };
+            vector<char> seen(count);
+            seen[0] = 1;
+            while (!stack.empty()) {
+                auto& top = stack.back();
+                if (top.second < edgeStart[top.first + 1]) {
+                    auto to = edgeTo[top.second++];
+                    if (!seen[to]) {
+                        seen[to] = 1;
+                        stack.push_back({ to, edgeStart[to] });
+                    }
+                    continue;
+                }
+                post[top.first] = (int)order.size();
+                order.push_back(top.first);
+                stack.pop_back();
+            }
+            std::reverse(order.begin(), order.end());
+
+            vector<vector<int>> preds(count);
+            for (int v = 0; v < count; v++)
+                for (auto e = edgeStart[v]; e < edgeStart[v + 1]; e++)
+                    if (seen[v]) preds[edgeTo[e]].push_back(v);
+
+            vector<int> idom(count, -1);
+            idom[0] = 0;
+            for (auto changed = true; changed;) {
+                changed = false;
+                for (size_t i = 1; i < order.size(); i++) {
+                    auto v = order[i];
+                    auto d = -1;
+                    for (auto p : preds[v]) {
+                        if (idom[p] < 0) continue;
+                        if (d < 0) {
+                            d = p;
+                            continue;
+                        }
+                        auto a = p, b = d;
+                        while (a != b) {
+                            while (post[a] < post[b]) a = idom[a];
+                            while (post[b] < post[a]) b = idom[b];
+                        }
+                        d = a;
+                    }
+                    if (d != idom[v]) {
+                        idom[v] = d;
+                        changed = true;
+                    }
+                }
+            }
+
+            for (auto v : order) nodes[v].retained = nodes[v].size;
+            for (auto i = order.size(); i-- > 1;) nodes[idom[order[i]]].retained += nodes[order[i]].retained;
+        }
+
+        string path(int v) const
+        {
+            string r;
+            for (; v > 0; v = nodes[v].parent) r = r.empty() ? nodes[v].label : nodes[v].label + "." + r;
+            return r;
+        }
+    };
+
+    string LuaMgr::heapDiff(const char* before, const char* after, int n /*= 20*/)
+    {
+        HeapGraph a, b;
+        if (!a.load(loadFile(before))) return Sprintf("not a heap snapshot: %s\n", before);
+        if (!b.load(loadFile(after))) return Sprintf("not a heap snapshot: %s\n", after);
+
+        unordered_map<uint64_t, uint64_t> old;
+        for (size_t v = 1; v < a.nodes.size(); v++)
+            if (a.nodes[v].parent >= 0) old[a.nodes[v].key] += a.nodes[v].retained;
+
+        // objects sharing a path are taken together.
+        struct Delta { int node; int64_t retained, growth; };
+        unordered_map<uint64_t, Delta> deltas;
+        for (size_t v = 1; v < b.nodes.size(); v++) {
+            auto& node = b.nodes[v];
+            if (node.parent < 0) continue;
+            auto& d = deltas.emplace(node.key, Delta{ (int)v, 0, 0 }).first->second;
+            d.retained += node.retained;
+        }
+        vector<Delta> v;
+        for (auto& d : deltas) {
+            auto it = old.find(d.first);
+            d.second.growth = d.second.retained - (int64_t)(it != old.end() ? it->second : 0);
+            if (d.second.growth > 0) v.push_back(d.second);
+        }
+        // the deepest of a chain of objects growing by the same amount holds the growth.
+        std::sort(v.begin(), v.end(), [&](const Delta& x, const Delta& y) {
+            return x.growth != y.growth ? x.growth > y.growth : b.nodes[x.node].depth > b.nodes[y.node].depth;
+        });
+        if (n >= 0 && (int)v.size() > n) v.resize(n);
+
+        auto out = Sprintf("%lld -> %lld bytes reachable\n", (long long)a.nodes[0].retained, (long long)b.nodes[0].retained);
+        out += Sprintf("%12s %12s  %s\n", "+retained", "retained", "path (type name)");
+        for (auto& d : v) {
+            auto& node = b.nodes[d.node];
+            out += Sprintf("%+12lld %12lld  ", (long long)d.growth, (long long)d.retained);
+            out += b.path(d.node) + " (" + node.type + (node.name.empty() ? "" : " " + node.name) + ")\n";
+        }
+        return out;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // binding statistics
+
+#ifdef TLUA_BINDING_STATS
+
+    BindingCall::BindingCall(lua_State* L)
+    {
+        auto mgr = LuaMgr::get();
+        auto key = runningCFuncKey(L);
+        auto it = mgr->funcNames.find(key);
+        // unnamed ones, such as lambdas handed to a script, add up by their C function.
+        auto& s = mgr->bindings[it != mgr->funcNames.end() ? key : (const void*)runningCFunction(L)];
+        if (s.name.empty()) s.name = it != mgr->funcNames.end() ? it->second : "?";
+        stats = &s;
+        uncaught = std::uncaught_exceptions();
+        start = nowNs();
+    }
+
+    BindingCall::~BindingCall()
+    {
+        auto ns = (uint64_t)std::max<int64_t>(nowNs() - start, 0);
+        stats->calls++;
+        stats->totalNs += ns;
+        stats->maxNs = std::max(stats->maxNs, ns);
+        int bucket = 0;
+        while (bucket < BindingStats::Buckets - 1 && (ns >> (bucket + 1))) bucket++;
+        stats->histogram[bucket]++;
+        // Lua errors unwind as C++ exceptions when Lua is compiled as C++.
+        if (std::uncaught_exceptions() > uncaught) stats->errors++;
+    }
+
+    std::vector<BindingStats> LuaMgr::bindingStats() const
+    {
+        std::vector<BindingStats> v;
+        for (auto& i : bindings) if (i.second.calls) v.push_back(i.second);
+        std::sort(v.begin(), v.end(), [](const BindingStats& a, const BindingStats& b) { return a.totalNs > b.totalNs; });
+        return v;
+    }
+
+    void LuaMgr::resetBindingStats()
+    {
+        bindings.clear();
+    }
+
+#endif
+
+    //////////////////////////////////////////////////////////////////////////
+    // call tracing
+
+    struct LuaMgr::Tracer
+    {
+        struct Event
+        {
+            int64_t ts; // ns
+            const string* name; // null for an end event
+            uint32_t luaThread;
+        };
+
+        // one per OS thread, written only by its thread. readers take the events
+        // below head; while tracing runs the oldest of them may be overwritten.
+        struct Ring
+        {
+            uint32_t id;
+            vector<Event> events;
+            std::atomic<uint64_t> head{ 0 };
+
+            void push(const Event& e)
+            {
+                auto h = head.load(std::memory_order_relaxed);
+                events[h % events.size()] = e;
+                head.store(h + 1, std::memory_order_release);
+            }
+        };
+
+        struct Frame
+        {
+            ptrdiff_t func; // stack offset of the called function
+            bool emitted;
+        };
+
+        struct LuaThread
+        {
+            uint32_t id;
+            vector<Frame> frames;
+        };
+
+        struct Label
+        {
+            string name;
+            bool lua; // C functions go with their caller's filter
+            bool included;
+        };
+
+        // where a Proto's label was found. a collected Proto's address may be reused by
+        // another function.
+        struct ProtoLabel
+        {
+            const void* source;
+            int line;
+            const Label* label;
+        };
+
+        uint64_t generation = ++generations;
+        bool running = false;
+        int maxDepth = 0;
+        std::vector<string> modules;
+        size_t capacity = 0;
+        int64_t origin = 0;
+
+        std::mutex ringsLock; // taken once per thread, to register its ring
+        vector<unique_ptr<Ring>> rings;
+        unordered_map<lua_State*, LuaThread> threads;
+        // events point at the labels, they are never renamed.
+        std::map<string, std::map<int, Label>> luaLabels; // by source and line defined
+        unordered_map<const void*, Label> cLabels; // see cFuncKey
+        unordered_map<const void*, ProtoLabel> protos;
+        LuaThread* lastThread = nullptr;
+        lua_State* lastState = nullptr;
+
+        static std::atomic<uint64_t> generations;
+
+        Ring& ring()
+        {
+            // rings outlive their threads, so a trace can be saved after they exit.
+            static thread_local Ring* mine = nullptr;
+            static thread_local uint64_t owner = 0;
+            if (owner != generation) {
+                std::lock_guard<std::mutex> lock(ringsLock);
+                rings.emplace_back(new Ring());
+                mine = rings.back().get();
+                mine->id = (uint32_t)rings.size();
+                mine->events.resize(capacity);
+                owner = generation;
+            }
+            return *mine;
+        }
+
+        LuaThread& thread(lua_State* L)
+        {
+            if (L != lastState) {
+                auto& t = threads[L];
+                if (!t.id) t.id = (uint32_t)threads.size();
+                lastState = L;
+                lastThread = &t;
+            }
+            return *lastThread;
+        }
+
+        const Label& label(lua_State* L, lua_Debug* ar)
+        {
+            auto func = ar->i_ci->func;
+            Proto* p = ttisLclosure(func) ? ((LClosure*)val_(func).gc)->p : nullptr;
+            if (!p) {
+                auto key = cFuncKey(func);
+                auto& l = cLabels[key];
+                if (l.name.empty()) {
+                    auto it = key ? instance->funcNames.find(key) : instance->funcNames.end();
+                    if (it != instance->funcNames.end()) {
+                        l.name = it->second;
+                    }
+                    else {
+                        lua_getinfo(L, "n", ar);
+                        l.name = ar->name ? ar->name : "[C]";
+                    }
+                    l.lua = false;
+                    l.included = true;
+                }
+                return l;
+            }
+
+            auto& seen = protos[p];
+            const void* source = p->source;
+            if (seen.label && seen.source == source && seen.line == p->linedefined) return *seen.label;
+            lua_getinfo(L, "Sn", ar);
+            auto& l = luaLabels[ar->source][ar->linedefined];
+            if (l.name.empty()) {
+                auto where = Sprintf("%s:%d", ar->short_src, ar->linedefined);
+                l.name = *ar->what == 'm' ? "main " + where : ar->name ? string(ar->name) + " " + where : where;
+                l.lua = true;
+                l.included = modules.empty();
+                for (auto& m : modules) if (strstr(ar->source, m.c_str())) l.included = true;
+            }
+            seen = { source, p->linedefined, &l };
+            return l;
+        }
+
+        void call(lua_State* L, lua_Debug* ar, bool tail)
+        {
+            auto& t = thread(L);
+            auto& r = ring();
+            auto func = ar->i_ci->func - L->stack;
+            // a tail call ends the caller and takes over its slot.
+            if (tail && !t.frames.empty()) {
+                if (t.frames.back().emitted) r.push({ nowNs() - origin, nullptr, t.id });
+                func = t.frames.back().func;
+                t.frames.pop_back();
+            }
+            // frames left by an error unwinding the stack end here.
+            while (!t.frames.empty() && t.frames.back().func >= func) {
+                if (t.frames.back().emitted) r.push({ nowNs() - origin, nullptr, t.id });
+                t.frames.pop_back();
+            }
+
+            auto& l = label(L, ar);
+            // calls made before tracing started are unknown, so a C function
+            // without a traced caller only shows when nothing is filtered out.
+            auto parentIncluded = t.frames.empty() ? modules.empty() : t.frames.back().emitted;
+            auto include = (maxDepth <= 0 || (int)t.frames.size() < maxDepth) && (l.lua ? l.included : parentIncluded);
+            t.frames.push_back({ func, include });
+            if (include) r.push({ nowNs() - origin, &l.name, t.id });
+        }
+
+        void ret(lua_State* L, lua_Debug* ar)
+        {
+            auto& t = thread(L);
+            auto& r = ring();
+            auto func = ar->i_ci->func - L->stack;
+            while (!t.frames.empty() && t.frames.back().func >= func) {
+                if (t.frames.back().emitted) r.push({ nowNs() - origin, nullptr, t.id });
+                t.frames.pop_back();
+            }
+        }
+
+        // closes the calls still running, so every begin event has its end.
+        void finish()
+        {
+            auto& r = ring();
+            auto ts = nowNs() - origin;
+            for (auto& it : threads) {
+                for (auto& f : it.second.frames) if (f.emitted) r.push({ ts, nullptr, it.second.id });
+                it.second.frames.clear();
+            }
+        }
+    };
+
+    std::atomic<uint64_t> LuaMgr::Tracer::generations{ 0 };
+
+    bool LuaMgr::startTrace(int maxDepth /*= 0*/, const std::vector<string>& modules /*= {}*/, size_t capacity /*= 1 << 16*/)
+    {
+        stopTrace();
+        if (!capacity) return false;
+        trace.reset(new Tracer());
+        auto& t = *trace;
+        t.maxDepth = maxDepth;
+        t.modules = modules;
+        t.capacity = capacity;
+        t.origin = nowNs();
+        t.running = true;
+        updateHook();
+        return true;
+    }
+
+    void LuaMgr::stopTrace()
+    {
+        if (!trace || !trace->running) return;
+        trace->running = false;
+        trace->finish();
+        updateHook();
+    }
+
+    static void appendJsonString(string& out, const string& s)
+    {
+        out += '"';
+        for (auto c : s) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += c;
+            }
+            else if ((unsigned char)c < 0x20) {
+                out += Sprintf("\\u%04x", c);
+            }
+            else {
+                out += c;
+            }
+        }
+        out += '"';
+    }
+
+    string LuaMgr::traceJson() const
+    {
+        string out = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+        if (trace) {
+            auto& t = *trace;
+            // pid is the OS thread, tid the Lua thread (coroutine) running on it.
+            std::lock_guard<std::mutex> lock(t.ringsLock);
+            unordered_map<uint32_t, bool> luaThreads;
+            for (auto& r : t.rings) {
+                out += Sprintf("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"args\":{\"name\":\"thread %u\"}},\n", r->id, r->id);
+                auto head = r->head.load(std::memory_order_acquire);
+                auto size = (uint64_t)r->events.size();
+                for (auto i = head > size ? head - size : 0; i < head; i++) {
+                    auto& e = r->events[i % size];
+                    if (!luaThreads[e.luaThread]) {
+                        luaThreads[e.luaThread] = true;
+                        out += Sprintf("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,\"args\":{\"name\":\"%s %u\"}},\n",
+                            r->id, e.luaThread, e.luaThread == 1 ? "lua" : "coroutine", e.luaThread);
+                    }
+                    out += "{\"ph\":\"";
+                    out += e.name ? 'B' : 'E';
+                    out += Sprintf("\",\"ts\":%.3f,\"pid\":%u,\"tid\":%u", e.ts / 1000.0, r->id, e.luaThread);
+                    if (e.name) {
+                        out += ",\"name\":";
+                        appendJsonString(out, *e.name);
+                    }
+                    out += "},\n";
+                }
+            }
+        }
+        if (out.back() == '\n' && out[out.size() - 2] == ',') out.erase(out.size() - 2, 1);
+        out += "]}\n";
+        return out;
+    }
+
+    bool LuaMgr::saveTrace(const char* path) const
+    {
+        if (!writeFileAtomic(path, traceJson())) {
+            logError(Sprintf("can not write trace: %s", path).c_str());
+            return false;
+        }
+        return true;
+    }
+
+#ifdef TLUA_OPCODE_STATS
+    //////////////////////////////////////////////////////////////////////////
+    // opcode statistics
+
+    LuaMgr::OpcodeCounts LuaMgr::opcodeStats(bool pairs /*= false*/) const
+    {
+        const int n = LUA_NUMOPCODES;
+        std::vector<lua_Unsigned> counts(pairs ? n * n : n);
+        lua_getopstats(L, pairs ? nullptr : counts.data(), pairs ? counts.data() : nullptr, 0);
+        OpcodeCounts out;
+        for (size_t i = 0; i < counts.size(); i++) {
+            if (!counts[i]) continue;
+            auto name = pairs ? string(lua_opname((int)i / n)) + " " + lua_opname((int)i % n) : string(lua_opname((int)i));
+            out.emplace_back(std::move(name), (uint64_t)counts[i]);
+        }
+        std::sort(out.begin(), out.end(), [](auto& a, auto& b) { return a.second > b.second; });
+        return out;
+    }
+
+    string LuaMgr::opcodeReport(int n /*= 20*/) const
+    {
+        auto ops = opcodeStats();
+        auto pairs = opcodeStats(true);
+        uint64_t total = 0;
+        for (auto& op : ops) total += op.second;
+        string out = Sprintf("%llu instructions\n", (unsigned long long)total);
+        if (!total) return out;
+        for (int i = 0; i < n && i < (int)ops.size(); i++)
+            out += Sprintf("%14llu %5.1f%%  %s\n", (unsigned long long)ops[i].second, ops[i].second * 100.0 / total, ops[i].first.c_str());
+        out += "pairs:\n";
+        for (int i = 0; i < n && i < (int)pairs.size(); i++)
+            out += Sprintf("%14llu %5.1f%%  %s\n", (unsigned long long)pairs[i].second, pairs[i].second * 100.0 / total, pairs[i].first.c_str());
+        return out;
+    }
+
+    void LuaMgr::resetOpcodeStats()
+    {
+        lua_getopstats(L, nullptr, nullptr, 1);
+    }
+#endif
+
+    //////////////////////////////////////////////////////////////////////////
+    // line counts
+
+    void LuaMgr::startLineCounts()
+    {
+        lua_linecount(L, LUA_LINECOUNTSTART);
+    }
+
+    void LuaMgr::stopLineCounts()
+    {
+        lua_linecount(L, LUA_LINECOUNTSTOP);
+    }
+
+    void LuaMgr::clearLineCounts()
+    {
+        lua_linecount(L, LUA_LINECOUNTRESET);
+    }
+
+    // counts by chunk name and line.
+    using LineCounts = std::map<string, std::map<int, uint64_t>>;
+
+    static LineCounts lineCounts(lua_State* L)
+    {
+        LineCounts counts;
+        lua_getlinecounts(L, [](void* ud, const char* source, int line, lua_Unsigned count) {
+            auto& n = (*(LineCounts*)ud)[source][line];
+            n = std::max(n, (uint64_t)count);
+        }, &counts);
+        return counts;
+    }
+
+    string LuaMgr::lineCountsLcov() const
+    {
+        string out;
+        for (auto& source : lineCounts(L)) {
+            // chunks from doString are named by their code.
+            auto& chunk = source.first;
+            if (chunk.size() < 4 || chunk.compare(chunk.size() - 4, 4, ".lua") != 0) continue;
+            out += "SF:" + srcDir + "/" + chunk + "\n";
+            int hit = 0;
+            for (auto& line : source.second) {
+                out += Sprintf("DA:%d,%llu\n", line.first, (unsigned long long)line.second);
+                if (line.second) hit++;
+            }
+            out += Sprintf("LH:%d\nLF:%d\nend_of_record\n", hit, (int)source.second.size());
+        }
+        return out;
+    }
+
+    string LuaMgr::annotateLineCounts(const char* chunk) const
+    {
+        auto counts = lineCounts(L);
+        auto& lines = counts[chunk];
+        auto text = fileLoader((srcDir + "/" + chunk).c_str());
+        string out;
+        if (text.empty()) {
+            // packed or precompiled without the source at hand.
+            for (auto& l : lines) out += Sprintf("%10llu  line %d\n", (unsigned long long)l.second, l.first);
+            return out;
+        }
+        int line = 1;
+        for (size_t pos = 0; pos < text.size(); line++) {
+            auto end = text.find('\n', pos);
+            if (end == string::npos) end = text.size();
+            auto it = lines.find(line);
+            out += it == lines.end() ? string(12, ' ') : Sprintf("%10llu  ", (unsigned long long)it->second);
+            out.append(text, pos, end - pos);
+            out += '\n';
+            pos = end + 1;
+        }
+        return out;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // latency watchdog
+
+    static volatile sig_atomic_t watchdogTick = 0;
+    bool WatchedCall::active = false;
+
+    struct LuaMgr::Watchdog
+    {
+        struct Scope
+        {
+            WatchedCall::Kind kind;
+            const char* what;
+            const void* binding; // see cFuncKey
+            lua_State* L; // the thread it was called on
+            int64_t start;
+            uint64_t generation;
+            bool logged = false; // itself or a call inside it
+            string chain, stack; // taken once it overran
+
+            Scope(WatchedCall::Kind kind, const char* what, const void* binding, lua_State* L, int64_t start, uint64_t generation)
+                : kind(kind), what(what), binding(binding), L(L), start(start), generation(generation)
+            {}
+        };
+
+        int64_t thresholdNs = 0;
+        size_t capacity = 0;
+        vector<Scope> scopes; // innermost last
+        std::deque<SlowCall> log;
+        uint64_t generations = 0;
+        // the innermost scope, for the ticker.
+        std::atomic<int64_t> since{ 0 };
+        std::atomic<uint64_t> current{ 0 };
+        std::thread ticker;
+        std::atomic<bool> ticking{ false };
+
+        void publish()
+        {
+            current.store(scopes.empty() ? 0 : scopes.back().generation, std::memory_order_relaxed);
+            since.store(scopes.empty() ? 0 : scopes.back().start, std::memory_order_release);
+        }
+
+        string describe(const Scope& s) const
+        {
+            switch (s.kind) {
+            case WatchedCall::Binding: {
+                auto& names = instance->funcNames;
+                auto it = names.find(s.binding);
+                return it != names.end() ? it->second : "[C]";
+            }
+            case WatchedCall::Call:
+                return "LuaRef::call";
+            case WatchedCall::DoFile:
+                return string("doFile ") + (s.what ? s.what : "");
+            default: {
+                // chunks are named by their source, keep its first line.
+                string src = s.what ? s.what : "";
+                auto end = std::min(src.find('\n'), (size_t)60);
+                return "doString " + src.substr(0, end) + (end < src.size() ? "..." : "");
+            }
+            }
+        }
+
+        string chain(size_t depth) const
+        {
+            string r;
+            for (size_t i = 0; i <= depth && i < scopes.size(); i++) r += (i ? " > " : "") + describe(scopes[i]);
+            return r;
+        }
+
+        // in the hook or at the end of a bound call: the stack of every scope that overran
+        // and has none yet.
+        void capture(lua_State* L)
+        {
+            auto now = nowNs();
+            string stack;
+            for (size_t i = 0; i < scopes.size(); i++) {
+                auto& s = scopes[i];
+                if (!s.stack.empty() || now - s.start < thresholdNs) continue;
+                if (stack.empty()) {
+                    luaL_traceback(L, L, nullptr, 0);
+                    stack = lua_tostring(L, -1);
+                    lua_pop(L, 1);
+                }
+                s.chain = chain(scopes.size() - 1);
+                s.stack = stack;
+            }
+        }
+
+        void leave(size_t depth, bool unwinding)
+        {
+            if (depth >= scopes.size()) return;
+            auto& s = scopes[depth];
+            auto ns = nowNs() - s.start;
+            // the innermost slow call takes the blame, not the ones it ran in.
+            if (ns >= thresholdNs && !s.logged && ticking) {
+                if (s.stack.empty() && s.kind == WatchedCall::Binding && !unwinding) capture(s.L);
+                if (log.size() >= capacity) log.pop_front();
+                log.push_back({ describe(s), s.chain.empty() ? chain(depth) : s.chain, ns / 1e6, s.stack });
+                s.logged = true;
+            }
+            if (s.logged && depth > 0) scopes[depth - 1].logged = true;
+            scopes.erase(scopes.begin() + depth, scopes.end());
+            publish();
+        }
+    };
+
+    void WatchedCall::enter(Kind kind, const char* what, lua_State* L)
+    {
+        if (!L) L = LuaObj::L;
+        auto mgr = LuaMgr::get();
+        uncaught = std::uncaught_exceptions();
+        if (mgr->watchdog && mgr->watchdog->ticking) {
+            auto& w = *mgr->watchdog;
+            depth = (int)w.scopes.size();
+            w.scopes.emplace_back(kind, what, kind == Binding ? runningCFuncKey(L) : nullptr, L, nowNs(), ++w.generations);
+            w.publish();
+        }
+        auto& b = mgr->defaultBudget;
+        if (kind != Binding && (b.instructions || b.ms > 0)) {
+            budgeted = true;
+            if (mgr->budgetRun.depth++ == 0) {
+                auto now = nowNs();
+                mgr->budgetRun = { 1, 0, b.instructions, now, b.ms > 0 ? now + (int64_t)(b.ms * 1e6) : 0, std::max(b.checkInterval, 1) };
+                mgr->updateHook();
+            }
+        }
+    }
+
+    void WatchedCall::leave()
+    {
+        auto mgr = LuaMgr::get();
+        if (!mgr) return;
+        // Lua errors unwind as C++ exceptions, the stack is not to be used then.
+        if (depth >= 0 && mgr->watchdog) mgr->watchdog->leave(depth, std::uncaught_exceptions() > uncaught);
+        if (budgeted && --mgr->budgetRun.depth == 0) {
+            mgr->budgetRun = {};
+            mgr->updateHook();
+        }
+    }
+
+    void LuaMgr::updateWatchedCalls()
+    {
+        WatchedCall::active = (watchdog && watchdog->ticking) || defaultBudget.instructions || defaultBudget.ms > 0;
+    }
+
+    bool LuaMgr::startWatchdog(double thresholdMs, size_t capacity /*= 64*/)
+    {
+        stopWatchdog();
+        if (thresholdMs <= 0 || !capacity) return false;
+        if (!watchdog) watchdog.reset(new Watchdog());
+        auto& w = *watchdog;
+        w.thresholdNs = (int64_t)(thresholdMs * 1e6);
+        w.capacity = capacity;
+        while (w.log.size() > capacity) w.log.pop_front();
+        // checks a few times per threshold, so an overrun is caught at most a quarter late.
+        auto period = std::chrono::microseconds(std::clamp<int64_t>(w.thresholdNs / 4000, 100, 100000));
+        // the ticker arms with the mask the main state has now.
+        updateHook();
+        w.ticking = true;
+        w.ticker = helperThread([&w, period] {
+            uint64_t armed = 0;
+            while (w.ticking) {
+                std::this_thread::sleep_for(period);
+                auto current = w.current.load(std::memory_order_relaxed);
+                auto since = w.since.load(std::memory_order_acquire);
+                if (!w.ticking || !since || current == armed || nowNs() - since < w.thresholdNs) continue;
+                armed = current;
+                watchdogTick = 1;
+                if (auto L = LuaObj::L) armHook(L);
+            }
+        });
+        updateWatchedCalls();
+        return true;
+    }
+
+    void LuaMgr::stopWatchdog()
+    {
+        if (!watchdog || !watchdog->ticking) return;
+        auto& w = *watchdog;
+        w.ticking = false;
+        updateWatchedCalls();
+        w.ticker.join();
+        watchdogTick = 0;
+        updateHook();
+    }
+
+    std::vector<LuaMgr::SlowCall> LuaMgr::slowCalls() const
+    {
+        if (!watchdog) return {};
+        return { watchdog->log.begin(), watchdog->log.end() };
+    }
+
+    string LuaMgr::watchdogReport() const
+    {
+        string out;
+        for (auto& c : slowCalls()) {
+            out += Sprintf("%.3f ms ", c.ms) + c.call + "\n  in " + c.chain + "\n";
+            out += c.stack.empty() ? "  (no Lua stack)\n" : "  " + c.stack + "\n";
+        }
+        return out;
+    }
+
+    function<void()> LuaMgr::pauseThreads()
+    {
+        auto hz = profiler && profiler->running ? profiler->hz : 0;
+        auto watchMs = watchdog && watchdog->ticking ? watchdog->thresholdNs / 1e6 : 0;
+        auto watchCapacity = watchdog ? watchdog->capacity : 0;
+        // the freer is drained first, nothing queued is left behind in a child.
+        auto freeThreshold = deferredFree ? deferredFree->threshold : 0;
+        auto freeCapacity = deferredFree ? deferredFree->queue.size() : 0;
+        stopProfiler();
+        stopWatchdog();
+        setDeferredFree(0);
+        return [this, hz, watchMs, watchCapacity, freeThreshold, freeCapacity] {
+            if (freeThreshold) setDeferredFree(freeThreshold, freeCapacity);
+            if (watchMs > 0) startWatchdog(watchMs, watchCapacity);
+            if (hz) startProfiler(hz);
+        };
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // call budgets
+
+    void LuaMgr::setCallBudget(const Budget& budget)
+    {
+        // a call already running keeps the budget it started with.
+        defaultBudget = budget;
+        updateWatchedCalls();
+    }
+
+    LuaMgr::BudgetScope::BudgetScope(LuaMgr& mgr, const Budget& budget)
+        : mgr(mgr), saved(mgr.defaultBudget), outer(mgr.budgetRun)
+    {
+        mgr.budgetRun = {};
+        mgr.setCallBudget(budget);
+        mgr.updateHook();
+    }
+
+    LuaMgr::BudgetScope::~BudgetScope()
+    {
+        mgr.setCallBudget(saved);
+        mgr.budgetRun = outer;
+        mgr.updateHook();
+    }
+
+    void LuaMgr::checkBudget(lua_State* L)
+    {
+        auto& run = budgetRun;
+        run.used += lua_gethookcount(L);
+        auto now = nowNs();
+        if ((!run.limit || run.used < run.limit) && (!run.deadline || now < run.deadline)) return;
+        if (L == run.yieldable) {
+            run.yielded = true;
+            lua_yield(L, 0);
+            return;
+        }
+        // raised once: the budget stops here and the error unwinds to the host call,
+        // which reports it like any other.
+        run.spent = true;
+        updateHook();
+        if (L != LuaObj::L) setThreadHook(L);
+        luaL_where(L, 0);
+        lua_pushfstring(L, "script budget exhausted: %I instructions, %f ms", (lua_Integer)run.used, (lua_Number)((now - run.start) / 1e6));
+        lua_concat(L, 2);
+        lua_error(L);
+    }
+
+    LuaMgr::ResumeResult LuaMgr::resume(LuaRef& co, const Budget& budget)
+    {
+        ResumeResult r;
+        auto top = lua_gettop(L);
+        co.push();
+        if (lua_isfunction(L, -1)) {
+            // start a coroutine with it, which co holds from now on.
+            auto thread = lua_newthread(L);
+            newThreadHook(L, thread);
+            lua_pushvalue(L, -2);
+            lua_xmove(L, thread, 1);
+            co = LuaRef::fromStack();
+            co.push();
+        }
+        auto thread = lua_tothread(L, -1);
+        if (!thread || (lua_status(thread) == LUA_OK && lua_gettop(thread) == 0)) {
+            logError("resume: not a suspended coroutine");
+            lua_settop(L, top);
+            r.status = LUA_ERRRUN;
+            return r;
+        }
+        // arguments pushed on a fresh thread along with its function.
+        auto narg = lua_status(thread) == LUA_OK ? lua_gettop(thread) - 1 : 0;
+        lua_xmove(thread, L, narg);
+
+        // a resume nested in a budgeted call runs on its own budget.
+        auto outer = budgetRun;
+        auto now = nowNs();
+        budgetRun = { 1, 0, budget.instructions, now, budget.ms > 0 ? now + (int64_t)(budget.ms * 1e6) : 0, std::max(budget.checkInterval, 1), thread };
+        updateHook();
+        auto n = resumeThread(L, thread, narg, &r.status);
+        r.budgetYield = r.status == LUA_YIELD && budgetRun.yielded;
+        budgetRun = outer;
+        updateHook();
+
+        if (n < 0) {
+            logError(lua_tostring(L, -1));
+        }
+        else {
+            r.values.resize(n);
+            for (auto i = n; i-- > 0;) r.values[i] = LuaRef::fromStack();
+        }
+        lua_settop(L, top);
+        return r;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // debug hook, shared by the profiling tools
+
+    // a hook found on a thread when ours went in, set with debug.sethook or by a
+    // debugger. ours calls it for its events until the thread gets it back.
+    struct ForeignHook
+    {
+        lua_State* L;
+        lua_Hook hook = nullptr;
+        int mask = 0, count = 0;
+        int left = 0; // instructions to its next count event
+    };
+    // the main thread's, then those of the coroutines being resumed.
+    static vector<ForeignHook> foreignHooks;
+
+    static ForeignHook* foreignHook(lua_State* L)
+    {
+        for (auto& f : foreignHooks) if (f.L == L) return &f;
+        return nullptr;
+    }
+
+    // installs the hooks the enabled tools need all the time, and the count hook of a
+    // call budget. the profiler and the watchdog arm a one-shot count hook on top of these.
+    void LuaMgr::updateHook()
+    {
+        int mask = 0, count = 0;
+        if (trace && trace->running) mask |= LUA_MASKCALL | LUA_MASKRET;
+        if (budgetRun.depth && !budgetRun.spent) {
+            mask |= LUA_MASKCOUNT;
+            count = budgetRun.interval;
+        }
+        baseHookMask = mask;
+        baseHookCount = count;
+        setThreadHook(L);
+        updateThreadHook();
+    }
+
+    // on while coroutines need our hook, or the memory profiler the thread they run on.
+    void LuaMgr::updateThreadHook()
+    {
+        threadHookWanted = baseHookMask || (memoryProfiler && memoryProfiler->alloc);
+        if (threadHookWanted) lua_setthreadhook(L, threadHook);
+        else if (resumedThreads.empty()) lua_setthreadhook(L, nullptr);
+    }
+
+    // the one-shot: our hook on the next instruction of the main state, from the
+    // profiler's timer or the watchdog's thread, which only set their flag before. the
+    // VM thread keeps the rest: a foreign hook is taken in when ours goes on or comes off
+    // the main state, so one set with debug.sethook since is lost to the next tick.
+    void LuaMgr::armHook(lua_State* L)
+    {
+        lua_sethook(L, hook, armHookMask | LUA_MASKCOUNT, 1);
+    }
+
+    // puts our hook on L with the base mask, taking in a foreign hook found there. without
+    // a base mask L gets its foreign hook back.
+    void LuaMgr::setThreadHook(lua_State* L)
+    {
+        auto f = foreignHook(L);
+        auto current = lua_gethook(L);
+        if (current && current != hook) {
+            if (!f) {
+                foreignHooks.push_back({ L });
+                f = &foreignHooks.back();
+            }
+            *f = { L, current, lua_gethookmask(L), lua_gethookcount(L), lua_gethookcount(L) };
+        }
+        else if (!current && f) {
+            // the main state's foreign hook was given back and removed since.
+            foreignHooks.erase(foreignHooks.begin() + (f - foreignHooks.data()));
+            f = nullptr;
+        }
+        if (!baseHookMask) {
+            releaseThreadHook(L);
+            return;
+        }
+        int mask = baseHookMask, count = baseHookCount;
+        if (f) {
+            mask |= f->mask;
+            // checkBudget counts what really ran, so the budget may check more often.
+            if (f->mask & LUA_MASKCOUNT) count = baseHookMask & LUA_MASKCOUNT ? std::min(count, f->count) : f->count;
+        }
+        lua_sethook(L, hook, mask, count);
+        if (L == LuaObj::L) armHookMask = mask;
+    }
+
+    // gives L its foreign hook back, or none. the main state's stays known for the
+    // one-shot to chain to.
+    void LuaMgr::releaseThreadHook(lua_State* L)
+    {
+        auto f = foreignHook(L);
+        if (lua_gethook(L) == hook) {
+            if (f) lua_sethook(L, f->hook, f->mask, f->count);
+            else lua_sethook(L, nullptr, 0, 0);
+        }
+        if (L == LuaObj::L) armHookMask = f ? f->mask : 0;
+        else if (f) foreignHooks.erase(foreignHooks.begin() + (f - foreignHooks.data()));
+    }
+
+    // a thread created by L copies its hook. it gets L's own instead of ours, which
+    // goes on it while it is resumed.
+    void LuaMgr::newThreadHook(lua_State* L, lua_State* co)
+    {
+        if (lua_gethook(co) != hook) return;
+        if (auto f = foreignHook(L)) lua_sethook(co, f->hook, f->mask, f->count);
+        else lua_sethook(co, nullptr, 0, 0);
+    }
+
+    // auxresume of the coroutine library: moves narg values from L to co, resumes it and
+    // moves back its results, or the error message. returns how many results, -1 on error.
+    int LuaMgr::resumeThread(lua_State* L, lua_State* co, int narg, int* status /*= nullptr*/)
+    {
+        if (!lua_checkstack(co, narg)) {
+            lua_pushliteral(L, "too many arguments to resume");
+            return -1;
+        }
+        if (lua_status(co) == LUA_OK && lua_gettop(co) == 0) {
+            lua_pushliteral(L, "cannot resume dead coroutine");
+            return -1;
+        }
+        lua_xmove(L, co, narg);
+        auto r = lua_resume(co, L, narg);
+        if (status) *status = r;
+        if (r != LUA_OK && r != LUA_YIELD) {
+            lua_xmove(co, L, 1);
+            return -1;
+        }
+        auto nres = lua_gettop(co);
+        if (!lua_checkstack(L, nres + 1)) {
+            lua_pop(co, nres);
+            lua_pushliteral(L, "too many results to resume");
+            return -1;
+        }
+        lua_xmove(co, L, nres);
+        return nres;
+    }
+
+    // follows the coroutines: a new one gets its creator's own hook rather than ours, and
+    // one being resumed gets ours for as long as it runs.
+    void LuaMgr::threadHook(lua_State* L, lua_State* from, int event)
+    {
+        if (event == LUA_THREADNEW) {
+            newThreadHook(from, L);
+        }
+        else if (event == LUA_THREADRESUME) {
+            resumedThreads.push_back(L);
+            if (baseHookMask) setThreadHook(L);
+        }
+        else {
+            if (!resumedThreads.empty() && resumedThreads.back() == L) resumedThreads.pop_back();
+            releaseThreadHook(L);
+            if (resumedThreads.empty() && !threadHookWanted) lua_setthreadhook(L, nullptr);
+        }
+    }
+
+    void LuaMgr::hook(lua_State* L, lua_Debug* ar)
+    {
+        // the foreign hook of this thread first, for the events it asked for.
+        if (auto f = foreignHook(L)) {
+            auto call = f->hook;
+            if (ar->event == LUA_HOOKCOUNT) {
+                if (!(f->mask & LUA_MASKCOUNT) || (f->left -= lua_gethookcount(L)) > 0) call = nullptr;
+                else f->left = f->count;
+            }
+            else if (!(f->mask & (ar->event == LUA_HOOKTAILCALL ? LUA_MASKCALL : 1 << ar->event))) {
+                call = nullptr;
+            }
+            if (call) call(L, ar);
+        }
+
+        auto trace = instance->trace.get();
+        if (ar->event == LUA_HOOKCALL || ar->event == LUA_HOOKTAILCALL) {
+            if (trace && trace->running) trace->call(L, ar, ar->event == LUA_HOOKTAILCALL);
+        }
+        else if (ar->event == LUA_HOOKRET) {
+            if (trace && trace->running) trace->ret(L, ar);
+        }
+        else if (ar->event == LUA_HOOKCOUNT && (ProfileTick::pending || watchdogTick)) {
+            auto profile = ProfileTick::pending, watch = watchdogTick;
+            ProfileTick::pending = 0;
+            watchdogTick = 0;
+            setThreadHook(L);
+            if (profile && instance->profiler && instance->profiler->running) instance->profiler->sample(L);
+            if (watch && instance->watchdog) instance->watchdog->capture(L);
+            // the one-shot replaced the budget's count, charge it a whole interval.
+            if (instance->budgetRun.depth && !instance->budgetRun.spent) instance->checkBudget(L);
+        }
+        else if (ar->event == LUA_HOOKCOUNT && instance->budgetRun.depth && !instance->budgetRun.spent) {
+            instance->checkBudget(L);
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // 'tlua' global: host tools reachable from scripts
+
+    void LuaMgr::openTLuaLib(lua_State* L)
+    {
+        static const luaL_Reg profilerFuncs[] = {
+            { "start", [](lua_State* L) {
+                lua_pushboolean(L, instance->startProfiler((int)luaL_optinteger(L, 1, 1000)));
+                return 1;
+            } },
+            { "stop", [](lua_State*) {
+                instance->stopProfiler();
+                return 0;
+            } },
+            { "clear", [](lua_State*) {
+                instance->clearProfile();
+                return 0;
+            } },
+            { "folded", [](lua_State* L) {
+                auto s = instance->profileFolded();
+                lua_pushlstring(L, s.data(), s.size());
+                return 1;
+            } },
+            { "top", [](lua_State* L) {
+                auto s = instance->profileTop((int)luaL_optinteger(L, 1, 20));
+                lua_pushlstring(L, s.data(), s.size());
+                return 1;
+            } },
+            { nullptr, nullptr }
+        };
+        static const luaL_Reg memoryFuncs[] = {
+            { "start", [](lua_State* L) {
+                lua_pushboolean(L, instance->startMemoryProfiler((size_t)luaL_optinteger(L, 1, 0)));
+                return 1;
+            } },
+            { "stop", [](lua_State*) {
+                instance->stopMemoryProfiler();
+                return 0;
+            } },
+            { "report", [](lua_State* L) {
+                auto s = instance->memoryReport((int)luaL_optinteger(L, 1, 20));
+                lua_pushlstring(L, s.data(), s.size());
+                return 1;
+            } },
+            { "usage", [](lua_State* L) {
+                auto u = instance->memoryUsage();
+                lua_createtable(L, 0, 4);
+                lua_pushinteger(L, (lua_Integer)u.current);
+                lua_setfield(L, -2, "current");
+                lua_pushinteger(L, (lua_Integer)u.peak);
+                lua_setfield(L, -2, "peak");
+                lua_pushinteger(L, (lua_Integer)u.limit);
+                lua_setfield(L, -2, "limit");
+                lua_pushinteger(L, (lua_Integer)u.failures);
+                lua_setfield(L, -2, "failures");
+                return 1;
+            } },
+            { nullptr, nullptr }
+        };
+
+        static const luaL_Reg heapFuncs[] = {
+            { "snapshot", [](lua_State* L) {
+                lua_pushboolean(L, instance->heapSnapshot(luaL_checkstring(L, 1)));
+                return 1;
+            } },
+            { "diff", [](lua_State* L) {
+                auto s = heapDiff(luaL_checkstring(L, 1), luaL_checkstring(L, 2), (int)luaL_optinteger(L, 3, 20));
+                lua_pushlstring(L, s.data(), s.size());
+                return 1;
+            } },
+            { nullptr, nullptr }
+        };
+
+        static const luaL_Reg watchdogFuncs[] = {
+            { "start", [](lua_State* L) {
+                lua_pushboolean(L, instance->startWatchdog(luaL_checknumber(L, 1), (size_t)luaL_optinteger(L, 2, 64)));
+                return 1;
+            } },
+            { "stop", [](lua_State*) {
+                instance->stopWatchdog();
+                return 0;
+            } },
+            { "log", [](lua_State* L) {
+                auto s = instance->watchdogReport();
+                lua_pushlstring(L, s.data(), s.size());
+                return 1;
+            } },
+            { nullptr, nullptr }
+        };
+
+        static const luaL_Reg traceFuncs[] = {
+            { "start", [](lua_State* L) {
+                std::vector<string> modules;
+                if (lua_istable(L, 2)) {
+                    for (int i = 1; lua_rawgeti(L, 2, i) == LUA_TSTRING; i++) {
+                        modules.push_back(lua_tostring(L, -1));
+                        lua_pop(L, 1);
+                    }
+                    lua_pop(L, 1);
+                }
+                lua_pushboolean(L, instance->startTrace((int)luaL_optinteger(L, 1, 0), modules));
+                return 1;
+            } },
+            { "stop", [](lua_State*) {
+                instance->stopTrace();
+                return 0;
+            } },
+            { "save", [](lua_State* L) {
+                lua_pushboolean(L, instance->saveTrace(luaL_checkstring(L, 1)));
+                return 1;
+            } },
+            { nullptr, nullptr }
+        };
+
+        static const luaL_Reg linesFuncs[] = {
+            { "start", [](lua_State*) {
+                instance->startLineCounts();
+                return 0;
+            } },
+            { "stop", [](lua_State*) {
+                instance->stopLineCounts();
+                return 0;
+            } },
+            { "clear", [](lua_State*) {
+                instance->clearLineCounts();
+                return 0;
+            } },
+            { "lcov", [](lua_State* L) {
+                auto s = instance->lineCountsLcov();
+                lua_pushlstring(L, s.data(), s.size());
+                return 1;
+            } },
+            { "annotate", [](lua_State* L) {
+                auto s = instance->annotateLineCounts(luaL_checkstring(L, 1));
+                lua_pushlstring(L, s.data(), s.size());
+                return 1;
+            } },
+            { nullptr, nullptr }
+        };
+
+        lua_newtable(L);
+        luaL_newlib(L, profilerFuncs);
+        lua_setfield(L, -2, "profiler");
+        luaL_newlib(L, memoryFuncs);
+        lua_setfield(L, -2, "memory");
+        luaL_newlib(L, heapFuncs);
+        lua_setfield(L, -2, "heap");
+        luaL_newlib(L, watchdogFuncs);
+        lua_setfield(L, -2, "watchdog");
+        luaL_newlib(L, traceFuncs);
+        lua_setfield(L, -2, "trace");
+        luaL_newlib(L, linesFuncs);
+        lua_setfield(L, -2, "lines");
+
+#ifdef TLUA_BINDING_STATS
+        // { { name=, calls=, errors=, exceptions=, time=, max=, histogram= }, ... }, times in seconds,
+        // histogram[k] counting calls that took [2^(k-1), 2^k) ns.
+        lua_pushcfunction(L, [](lua_State* L) {
+            auto stats = instance->bindingStats();
+            lua_createtable(L, (int)stats.size(), 0);
+            for (size_t i = 0; i < stats.size(); i++) {
+                auto& s = stats[i];
+                lua_createtable(L, 0, 7);
+                lua_pushlstring(L, s.name.data(), s.name.size());
+                lua_setfield(L, -2, "name");
+                lua_pushinteger(L, (lua_Integer)s.calls);
+                lua_setfield(L, -2, "calls");
+                lua_pushinteger(L, (lua_Integer)s.errors);
+                lua_setfield(L, -2, "errors");
+                lua_pushinteger(L, (lua_Integer)s.exceptions);
+                lua_setfield(L, -2, "exceptions");
+                lua_pushnumber(L, s.totalNs / 1e9);
+                lua_setfield(L, -2, "time");
+                lua_pushnumber(L, s.maxNs / 1e9);
+                lua_setfield(L, -2, "max");
+                lua_createtable(L, BindingStats::Buckets, 0);
+                for (int b = 0; b < BindingStats::Buckets; b++) {
+                    lua_pushinteger(L, (lua_Integer)s.histogram[b]);
+                    lua_rawseti(L, -2, b + 1);
+                }
+                lua_setfield(L, -2, "histogram");
+                lua_rawseti(L, -2, (lua_Integer)i + 1);
+            }
+            return 1;
+        });
+        lua_setfield(L, -2, "bindingStats");
+#endif
+#ifdef TLUA_OPCODE_STATS
+        // ops, pairs = tlua.opcodes([reset]): { MOVE = n, ... }, { ["MOVE CALL"] = n, ... }
+        lua_pushcfunction(L, [](lua_State* L) {
+            for (auto pairs : { false, true }) {
+                auto counts = instance->opcodeStats(pairs);
+                lua_createtable(L, 0, (int)counts.size());
+                for (auto& c : counts) {
+                    lua_pushinteger(L, (lua_Integer)c.second);
+                    lua_setfield(L, -2, c.first.c_str());
+                }
+            }
+            if (lua_toboolean(L, 1)) instance->resetOpcodeStats();
+            return 2;
+        });
+        lua_setfield(L, -2, "opcodes");
+#endif
+        lua_setglobal(L, "tlua");
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // LuaRef
+
+    int LuaRefBase::ref([[maybe_unused]] RefSite site)
+    {
+        auto r = luaL_ref(L, LUA_REGISTRYINDEX);
+        if (r == LUA_REFNIL || r == LUA_NOREF) return r;
+        refCounts.created++;
+        refCounts.peak = std::max(refCounts.peak, ++refCounts.live);
+#ifdef TLUA_REF_TRACKING
+        refSites.insert_or_assign(r, inSiteScope ? scopeSite : site);
+#endif
+        return r;
+    }
+
+    void LuaRefBase::unref(int r)
+    {
+        if (r == LUA_REFNIL || r == LUA_NOREF) return;
+        // refs outliving the state are gone with it.
+        if (L) luaL_unref(L, LUA_REGISTRYINDEX, r);
+        refCounts.live--;
+#ifdef TLUA_REF_TRACKING
+        refSites.erase(r);
+#endif
+    }
+
+    int LuaRefBase::replaceRef(int r)
+    {
+        RefSite site{};
+#ifdef TLUA_REF_TRACKING
+        auto it = refSites.find(r);
+        if (it != refSites.end()) site = it->second;
+#endif
+        unref(r);
+        return ref(site);
+    }
+
+    LuaMgr::RefStats LuaMgr::refStats()
+    {
+        return refCounts;
+    }
+
+    string LuaMgr::dumpRefs([[maybe_unused]] int n /*= 50*/) const
+    {
+        auto out = Sprintf("%zu live refs, peak %zu, %zu created\n", refCounts.live, refCounts.peak, refCounts.created);
+#ifdef TLUA_REF_TRACKING
+        // site and type -> count
+        map<pair<string, string>, size_t> groups;
+        for (auto& i : refSites) {
+            auto& site = i.second;
+            lua_rawgeti(L, LUA_REGISTRYINDEX, i.first);
+            string type = luaL_typename(L, -1);
+            if (lua_type(L, -1) == LUA_TUSERDATA && luaL_getmetafield(L, -1, "_name") == LUA_TSTRING) {
+                type = lua_tostring(L, -1);
+                lua_pop(L, 1);
+            }
+            lua_pop(L, 1);
+            groups[{ Sprintf("%s:%u %s", site.file_name(), (unsigned)site.line(), site.function_name()), type }]++;
+        }
+
+        vector<pair<size_t, const pair<string, string>*>> order;
+        for (auto& g : groups) order.push_back({ g.second, &g.first });
+        std::sort(order.begin(), order.end(), [](auto& a, auto& b) { return a.first > b.first; });
+        if (n >= 0 && (int)order.size() > n) order.resize(n);
+        for (auto& o : order) {
+            out += Sprintf("%8zu  %-10s ", o.first, o.second->second.c_str());
+            out += o.second->first + "\n";
+        }
+#endif
+        return out;
     }
 
-    void LuaRefBase::iniFromStack()
+    void LuaRefBase::iniFromStack(_TLuaRefSiteParam)
     {
-        m_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        m_ref = ref(site);
     }
 
     LuaRefBase::~LuaRefBase()
     {
-        if (m_ref != LUA_REFNIL && L)
-            luaL_unref(L, LUA_REGISTRYINDEX, m_ref);
+        unref(m_ref);
     }
 
     void LuaRefBase::push() const
@@ -232,17 +4374,16 @@ namespace tlua
         return lua_type(L, -1);
     }
 
-    int LuaRefBase::createRef() const
+    int LuaRefBase::createRef(_TLuaRefSiteParam) const
     {
         if (m_ref == LUA_REFNIL) return LUA_REFNIL;
         push();
-        return luaL_ref(L, LUA_REGISTRYINDEX);
+        return ref(site);
     }
 
     void LuaRefBase::pop()
     {
-        luaL_unref(L, LUA_REGISTRYINDEX, m_ref);
-        m_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        m_ref = replaceRef(m_ref);
     }
 
     bool LuaRefBase::isNil() const
@@ -288,32 +4429,35 @@ namespace tlua
         other.m_ref = LUA_REFNIL;
     }
 
-    LuaRef::LuaRef(TableProxy const& other)
+    LuaRef::LuaRef(TableProxy const& other _TLuaRefSiteParamArg)
     {
+        RefSiteScope scope(site);
         m_ref = other.createRef();
     }
 
-    LuaRef::LuaRef(LuaRef const& other)
+    LuaRef::LuaRef(LuaRef const& other _TLuaRefSiteParamArg)
     {
+        RefSiteScope scope(site);
         m_ref = other.createRef();
     }
 
-    tlua::LuaRef LuaRef::fromIndex(int index)
+    tlua::LuaRef LuaRef::fromIndex(int index _TLuaRefSiteParamArg)
     {
+        RefSiteScope scope(site);
         lua_pushvalue(L, index);
         return fromStack();
     }
 
-    tlua::LuaRef LuaRef::fromStack()
+    tlua::LuaRef LuaRef::fromStack(_TLuaRefSiteParam)
     {
         LuaRef r;
-        r.iniFromStack();
+        r.m_ref = ref(site);
         return r;
     }
 
     tlua::LuaRef& LuaRef::operator=(LuaRef&& other)
     {
-        luaL_unref(L, LUA_REGISTRYINDEX, m_ref);
+        unref(m_ref);
         m_ref = other.m_ref;
         other.m_ref = LUA_REFNIL;
         return *this;
@@ -7,8 +7,18 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <list>
+#include <cstdint>
 #include <functional>
+#include <memory>
 #include <cassert>
+#include <csignal>
+
+#ifdef TLUA_REF_TRACKING
+#include <source_location>
+#endif
 
 #ifndef TLUA_NO_MINI_LUA
 #include "lua.h"
@@ -19,30 +29,35 @@
 #endif
 
 
-#define TLuaType(Type, funcs) \
+#define TLuaType(Type, ...) \
     static auto __reg_##Type = (tlua::LuaMgr::getRegisters().push_back({#Type, []{ \
         using Class = Type; \
-		auto mgr =  tlua::LuaMgr::get(); \
-        auto table = mgr->newType<Type>(#Type), pget = mgr->newTable(), pset = mgr->newTable(); \
-		table["__prop_get"] = pget; table["__prop_set"] = pset; \
-		funcs \
+        static constexpr tlua::TypeReg regs[] = { __VA_ARGS__ { nullptr } }; \
+		tlua::LuaMgr::get()->newType<Type>(#Type, regs); \
 	} }), 1);
 
-#define _TLuaTypeBase(base)                             table["base"] = #base;
-#define TLuaTypeInherit(name, base, funcs)              TLuaType(name, funcs _TLuaTypeBase(base) )
+#define _TLuaTypeBase(base)                             { "base", _TLuaValue(#base), tlua::TypeReg::Value },
+#define TLuaTypeInherit(name, base, ...)                TLuaType(name, __VA_ARGS__ _TLuaTypeBase(base) )
 
-#define TLuaFieldValue(name, val)                       table[#name] = val;
-#define TLuaField(name)                                 table[#name] = Class::name;
-#define TLuaFieldAddr(name)                             table[#name] = &Class::name;
-#define TLuaProperty(name)								pget[#name] = [m=&Class::name](Class* c) {return c->*m; }; pset[#name] = [m=&Class::name](Class* c, tlua::helpers::Owner<decltype(&Class::name)>::type v) {c->*m = v; };
+// val is evaluated once, when the type is registered, in a function of its own: it
+// may call functions and name globals, statics and Class members, but not locals: it is
+// a plain function pointer in the static table of TLuaType, with no captures.
+#define TLuaFieldValue(name, val)                       { #name, _TLuaValue(val), tlua::TypeReg::Value },
+#define TLuaField(name)                                 { #name, _TLuaValue(Class::name), tlua::TypeReg::Value },
+#define TLuaFieldAddr(name)                             { #name, _TLuaFunc(&Class::name) },
+#define TLuaProperty(name)								{ #name, _TLuaFunc([](Class* c) {return c->name; }), tlua::TypeReg::Getter }, \
+                                                        { #name, _TLuaFunc([](Class* c, tlua::helpers::Owner<decltype(&Class::name)>::type v) {c->name = v; }), tlua::TypeReg::Setter },
 
-#define TLuaConstructor(...)                            table["New"] = &tlua::Construct<Class, ##__VA_ARGS__>;
-#define TLuaConstructorOverload(args, body)				table[_TLua_OverloadName(New, args)] = [] args { return new Class body; };
+#define TLuaConstructor(...)                            { "New", _TLuaFunc(&tlua::Construct<Class, ##__VA_ARGS__>) },
+#define TLuaConstructorOverload(args, body)				{ _TLua_OverloadName(New, args), _TLuaFunc([] args { return new Class body; }) },
 
-#define TLuaFuncOverload(name, args, body)				table[_TLua_OverloadName(name, args)] = [] args { return body; };
+#define TLuaFuncOverload(name, args, body)				{ _TLua_OverloadName(name, args), _TLuaFunc([] args { return body; }) },
 
 #define _TLua_OverloadName(name, args)					_TLua_ToStr(name) "#" _TLua_ToStr(_TLua_NARGS(_TLuaEatBrace(args)))
 
+// registration entries are plain C functions without upvalues, see tlua::TypeReg.
+#define _TLuaFunc(...)                                  [](lua_State* L) -> int { return tlua::FuncHelper::invoke(L, __VA_ARGS__); }
+#define _TLuaValue(...)                                 [](lua_State*) -> int { tlua::FuncHelper::pushValue(__VA_ARGS__); return 1; }
 
 //////////////////////////////////////////////////////////////////////////
 // overloading  helpers
@@ -52,6 +67,7 @@
 #define _TLua_ToStr(s)					_TLua_ToStrImp(s)
 #define _TLua_ToStrImp(s)				#s
 
+
 //https://stackoverflow.com/questions/26682812/argument-counting-macro-with-zero-arguments-for-visualstudio-2010
 #ifdef _MSC_VER
 
@@ -153,6 +169,38 @@ namespace tlua
     struct Nil
     {};
 
+    // one entry of the static registration table emitted by the TLuaType macros,
+    // installed in a single pass like luaL_setfuncs. a null name ends the table.
+    struct TypeReg
+    {
+        enum Kind { Func, Value, Getter, Setter };
+
+        const char* name;
+        lua_CFunction func = nullptr; // pushes the value itself for Value entries
+        Kind kind = Func;
+    };
+
+    // where a registry ref was created, see LuaMgr::dumpRefs. TLUA_REF_TRACKING (C++20)
+    // records it, otherwise it is an empty tag the compiler drops.
+#ifdef TLUA_REF_TRACKING
+    using RefSite = std::source_location;
+#else
+    struct RefSite
+    {
+        static constexpr RefSite current() { return {}; }
+    };
+#endif
+    // the entry points making refs take their caller's site as a last, defaulted argument
+    // only with TLUA_REF_TRACKING. otherwise they keep their plain signatures, so member
+    // pointers like &LuaMgr::doFile work.
+#ifdef TLUA_REF_TRACKING
+#define _TLuaRefSite                    RefSite site = RefSite::current()
+#define _TLuaRefSiteArg                 , _TLuaRefSite
+#else
+#define _TLuaRefSite
+#define _TLuaRefSiteArg
+#endif
+
     struct LuaObj
     {
         static lua_State* L;
@@ -166,9 +214,74 @@ namespace tlua
         };
     };
 
+#ifdef TLUA_BINDING_STATS
+    // call statistics of one bound C++ function, see LuaMgr::bindingStats. define
+    // TLUA_BINDING_STATS for the whole project to compile them in.
+    struct BindingStats
+    {
+        static constexpr int Buckets = 32; // bucket i counts calls taking [2^i, 2^(i+1)) ns
+
+        string name; // Type.name as registered, or the global name
+        uint64_t calls = 0;
+        uint64_t errors = 0; // calls that raised a Lua error
+        uint64_t exceptions = 0; // C++ exceptions, also counted as errors
+        uint64_t totalNs = 0, maxNs = 0;
+        uint64_t histogram[Buckets] = {};
+    };
+
+    // times one FuncHelper::callCpp, charged to the C function running on L.
+    class BindingCall
+    {
+    public:
+        explicit BindingCall(lua_State* L);
+        ~BindingCall();
+        void exception() { stats->exceptions++; }
+    private:
+        BindingStats* stats;
+        int uncaught;
+        int64_t start;
+    };
+#endif
+
+    // the sampling profiler's tick, set by its timer. a bound call it fired in is the
+    // leaf of the sample taken once Lua code runs again, see LuaMgr::startProfiler.
+    struct ProfileTick
+    {
+        static volatile sig_atomic_t pending;
+        static void inBinding(lua_State* L);
+    };
+
+    // a script call watched by the latency watchdog (see LuaMgr::startWatchdog) and
+    // held to the call budget (LuaMgr::setCallBudget). only tests a flag while neither
+    // is on.
+    class WatchedCall
+    {
+    public:
+        enum Kind { Binding, Call, DoFile, DoString };
+        // L is the thread a binding runs on, the main state for the rest.
+        explicit WatchedCall(Kind kind, const char* what = nullptr, lua_State* L = nullptr)
+        {
+            if (active) enter(kind, what, L);
+        }
+        ~WatchedCall()
+        {
+            if (depth >= 0 || budgeted) leave();
+        }
+        static bool active;
+    private:
+        void enter(Kind kind, const char* what, lua_State* L);
+        void leave();
+        int depth = -1;
+        bool budgeted = false;
+        int uncaught = 0;
+    };
+
     template<typename T, bool isEnum, bool isFunctor>
     struct StackHelper;
 
+    template<typename F>
+    struct Invoker;
+
     //////////////////////////////////////////////////////////////////////////
 
     template <typename T>
@@ -191,22 +304,46 @@ namespace tlua
     class FuncHelper : public LuaObj
     {
     public:
+        template<typename F>
+        static int invoke(lua_State* caller, F&& f)
+        {
+            return Invoker<decay_t<F>>::call(caller, f);
+        }
+        template<typename T>
+        static void pushValue(T&& v)
+        {
+            Stack<T>::push(forward<T>(v));
+        }
         template<typename R, typename... A, typename F>
-        static int callCpp(tuple<A...>*, int argsOffset, F&& f)
+        static int callCpp(lua_State* caller, tuple<A...>*, int argsOffset, F&& f)
         {
-            return callCpp<R, A...>(argsOffset, forward<F>(f));
+            return callCpp<R, A...>(caller, argsOffset, forward<F>(f));
         }
+        // caller is the thread the binding was called on, a coroutine or L.
         template<typename R, typename... A, typename F>
-        static int callCpp(int argsOffset, F&& f)
+        static int callCpp(lua_State* caller, int argsOffset, F&& f)
         {
+#ifdef TLUA_BINDING_STATS
+            BindingCall stats(caller);
+#endif
+#ifdef TLUA_WATCH_BINDINGS
+            WatchedCall watched(WatchedCall::Binding, nullptr, caller);
+#endif
             try {
                 Stack<R>::push((callCpp<R, A...>(argsOffset, forward<F>(f), make_index_sequence<sizeof...(A)>()), Nil()));
+                if (ProfileTick::pending) ProfileTick::inBinding(caller);
                 return std::is_same<R, void>::value ? 0 : 1;
             }
             catch (std::exception &e) {
+#ifdef TLUA_BINDING_STATS
+                stats.exception();
+#endif
                 luaL_error(L, "C++ exception: %s", e.what());
             }
             catch (...) {
+#ifdef TLUA_BINDING_STATS
+                stats.exception();
+#endif
                 luaL_error(L, "C++ exception: unknown");
             }
             return 0;
@@ -243,11 +380,11 @@ namespace tlua
     class LuaRefBase : public LuaObj
     {
     public:
-        void iniFromStack();
+        void iniFromStack(_TLuaRefSite);
         virtual ~LuaRefBase();
         virtual void push() const;
         int type() const;
-        int createRef() const;
+        int createRef(_TLuaRefSite) const;
         void pop();
         bool isNil() const;
         explicit operator bool()const;
@@ -264,6 +401,7 @@ namespace tlua
         template <typename R = void, typename... A>
         R call(A&&... a) const
         {
+            WatchedCall watched(WatchedCall::Call);
             push();
             return FuncHelper::callLua<R>(forward<A>(a)...);
         }
@@ -277,6 +415,12 @@ namespace tlua
             lua_pop(L, 1);
         }
     protected:
+        // luaL_ref/luaL_unref on the registry, with the accounting of LuaMgr::refStats.
+        static int ref(RefSite site);
+        static void unref(int ref);
+        // refs the top of the stack in place of ref, keeping its creation site.
+        static int replaceRef(int ref);
+
         int m_ref = LUA_REFNIL;
     };
 
@@ -315,12 +459,12 @@ namespace tlua
     public:
         LuaRef()
         {}
-        LuaRef(TableProxy const& other);
+        LuaRef(TableProxy const& other _TLuaRefSiteArg);
         LuaRef(LuaRef&& other);
         LuaRef& operator=(LuaRef&& other);
-        LuaRef(LuaRef const& other);
-        static LuaRef fromIndex(int index);
-        static LuaRef fromStack();
+        LuaRef(LuaRef const& other _TLuaRefSiteArg);
+        static LuaRef fromIndex(int index _TLuaRefSiteArg);
+        static LuaRef fromStack(_TLuaRefSite);
 
         template <typename T>
         TableProxy operator[] (T&& key) const
@@ -331,9 +475,8 @@ namespace tlua
         template <typename T>
         LuaRef& operator= (T&& rhs)
         {
-            luaL_unref(L, LUA_REGISTRYINDEX, m_ref);
             Stack<T>::push(forward<T>(rhs));
-            m_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+            m_ref = replaceRef(m_ref);
             return *this;
         }
         Iterator begin() const;
@@ -360,6 +503,32 @@ namespace tlua
 
     //////////////////////////////////////////////////////////////////////////
 
+    // read-only memory mapping of a whole file.
+    class MappedFile
+    {
+    public:
+        MappedFile()
+        {}
+        explicit MappedFile(const char* path);
+        MappedFile(MappedFile&& other);
+        MappedFile& operator=(MappedFile&& other);
+        ~MappedFile();
+        bool open(const char* path);
+        void close();
+        bool isOpen() const { return m_open; }
+        const char* data() const { return m_data; }
+        size_t size() const { return m_size; }
+        const string& error() const { return m_error; }
+    private:
+        const char* m_data = nullptr;
+        size_t m_size = 0;
+        void* m_mapping = nullptr;
+        bool m_open = false;
+        string m_error;
+    };
+
+    //////////////////////////////////////////////////////////////////////////
+
     class LuaMgr : public LuaObj
     {
     public:
@@ -369,20 +538,281 @@ namespace tlua
 
         function<void(const char*)> logError;
         function<string(const char*)> fileLoader;
+        // run in each prefork child with the worker index, e.g. to reopen sockets.
+        std::vector<function<void(int)>> afterFork;
+
+        enum Lib
+        {
+            LibBase = 1 << 0,
+            LibPackage = 1 << 1,
+            LibCoroutine = 1 << 2,
+            LibTable = 1 << 3,
+            LibIO = 1 << 4,
+            LibOS = 1 << 5,
+            LibString = 1 << 6,
+            LibMath = 1 << 7,
+            LibUtf8 = 1 << 8,
+            LibDebug = 1 << 9,
+            LibBit32 = 1 << 10,
+            LibSocket = 1 << 11,
+            LibAll = (1 << 12) - 1,
+        };
+
+        enum Allocator
+        {
+            AllocSystem, // malloc/realloc/free, as luaL_newstate
+            AllocPool,   // small blocks from per-state size-class slabs, see setPoolRetention
+        };
 
-        LuaMgr();
+        // libs are opened right away, lazyLibs on the first read of their global
+        // through a metatable on _G. method calls on strings need string opened eagerly.
+        LuaMgr(int libs = LibAll, int lazyLibs = 0, Allocator allocator = AllocSystem);
         virtual ~LuaMgr();
+        static void openLib(lua_State* L, int lib);
         void setSourceRoot(string luaRoot = "");
-        LuaRef doFile(const char *name);
-        LuaRef doString(const char* name);
-        LuaRef newTable();
-        LuaRef getGlobal(const char* name);
+        // position of the tlua loader in package.searchers: 1 runs it before package.preload,
+        // 2 right after it. 0 appends it after the standard searchers, which is the default.
+        void setLoaderPriority(int index);
+        // a module name not found under the source root is remembered as missing and not
+        // looked up again. clear after adding files or changing fileLoader.
+        void clearResolveCache();
+        // modules that only return a table constructor of literals are built directly,
+        // without the compiler. off by default; tools/tlua_datacheck compares it with the
+        // compiler on given files and a set of tricky chunks. TLUA_CHECK_DATA_CHUNKS also
+        // runs each one through the compiler, logs any difference and keeps the compiler's
+        // table then.
+        void setDataChunkLoader(bool enable);
+        // cache compiled modules as bytecode in cacheDir, empty to disable.
+        void setBytecodeCache(string cacheDir = "");
+        // resolve requires from a module pack first, see buildPack.
+        bool mountPack(const char* packFile);
+        void unmountPack();
+        // pack all .lua files under srcRoot, as bytecode if compile is set.
+        bool buildPack(const char* srcRoot, const char* packFile, bool compile = true);
+        // compile all .lua files under rootDir on a thread pool (0: one per core) and keep
+        // the bytecode in memory for require. returns the number of files that failed.
+        int precompile(const char* rootDir, int threads = 0);
+        void clearPrecompiled();
+
+        // forks workers sharing this warmed-up state copy-on-write (POSIX only). each child
+        // reseeds the rngs, runs afterFork and exits with workerMain(index). the parent
+        // gets the child pids. note the first GC cycle in a child touches every object.
+        std::vector<int> prefork(int workers, function<int(int)> workerMain);
+        // private dirty pages of a process (0: this one), i.e. pages copied or written
+        // since the fork. -1 if unknown.
+        static long dirtyPages(int pid = 0);
+        LuaRef doFile(const char *name _TLuaRefSiteArg);
+        LuaRef doString(const char* name _TLuaRefSiteArg);
+
+        // sampling profiler. a timer (process CPU time on POSIX, wall clock on Windows)
+        // arms a one-shot count hook hz times a second, which records the Lua stack at the
+        // next instruction. bound C++ functions show up as Type.name, and are the leaf of
+        // a sample the timer fired in; time in other C functions goes to their caller.
+        // time spent inside coroutines is charged to coroutine.resume. from Lua:
+        // tlua.profiler.start([hz]), stop(), clear(), folded(), top([n]).
+        bool startProfiler(int hz = 1000);
+        void stopProfiler();
+        void clearProfile();
+        // one "root;...;leaf count" line per distinct stack, as flamegraph.pl reads.
+        string profileFolded() const;
+        // the n functions with the most samples, by self and total time.
+        string profileTop(int n = 20) const;
+
+        // trace of Lua calls and returns, bound C++ calls included, kept in a ring of
+        // capacity events per OS thread (the oldest are overwritten). modules limits it to
+        // functions whose chunk name contains one of them, C functions following their
+        // caller; maxDepth to that many nested calls, 0 for no limit. coroutines are
+        // traced when created while tracing. from Lua: tlua.trace.start([maxDepth
+        // [, modules]]), stop(), save(path).
+        bool startTrace(int maxDepth = 0, const std::vector<string>& modules = {}, size_t capacity = 1 << 16);
+        void stopTrace();
+        // Chrome trace-event JSON for chrome://tracing or ui.perfetto.dev, one track per
+        // coroutine. consistent once tracing stopped.
+        string traceJson() const;
+        bool saveTrace(const char* path) const;
+
+        // per-line execution counts, kept by the VM in counters per instruction of each
+        // function run while counting (one that is running when counting starts counts
+        // from its next call or return into it). a line counts as often as its most
+        // executed instruction. from Lua: tlua.lines.start(), stop(), clear(), lcov(),
+        // annotate(chunk).
+        void startLineCounts();
+        void stopLineCounts();
+        void clearLineCounts();
+        // lcov tracefile of the loaded modules, paths under srcDir. functions that did
+        // not run show with 0 counts.
+        string lineCountsLcov() const;
+        // the module source (chunk as require names it, e.g. "ui/main.lua") with each
+        // line prefixed by its count.
+        string annotateLineCounts(const char* chunk) const;
+
+        // collector telemetry since the start or the last reset: cycles, pauses, bytes
+        // marked/swept/freed, atomic time. scripts get it from collectgarbage("stats").
+        lua_GCStats gcStats(bool reset = false);
+
+        // memory of the state: bytes in use, the most in use so far, and the limit (0 for
+        // none). failures counts allocations refused for the limit.
+        struct MemoryUsage
+        {
+            size_t current = 0, peak = 0, limit = 0;
+            uint64_t failures = 0;
+        };
+        // the state's allocator refuses to grow past limit bytes. Lua then runs an
+        // emergency collection and retries, and if that doesn't make room the script
+        // gets a memory error. onLimit hears of each such failure with the size asked
+        // for; it runs inside the allocator, so it must not use the state. from Lua:
+        // tlua.memory.usage() returns { current=, peak=, limit=, failures= }.
+        // the counting allocator is only put in by the first call, 0 meaning no limit:
+        // until then current is Lua's own count and peak is just current.
+        void setMemoryLimit(size_t limit, function<void(const MemoryUsage&, size_t requested)> onLimit = nullptr);
+        MemoryUsage memoryUsage() const;
+
+        // with AllocPool, blocks up to 256 bytes come from 64K slabs holding one size
+        // each, and bigger ones from malloc. a slab left empty is kept for reuse while
+        // fewer than keepEmpty (16 by default) are kept, and given back to the OS otherwise.
+        // small blocks are 8-byte aligned, not 16 like malloc's. that is all Lua needs:
+        // userdata memory follows a 40-byte header, so it is only 8-byte aligned with
+        // either allocator, and a type needing more must not be put in a userdata as is.
+        struct PoolStats
+        {
+            size_t slabs = 0, emptySlabs = 0; // mapped now, and how many of them are empty
+            uint64_t slabsMapped = 0, slabsReleased = 0, largeAllocs = 0;
+        };
+        void setPoolRetention(size_t keepEmpty);
+        PoolStats poolStats() const;
+
+        // frees of blocks of threshold bytes or more (at least 257) are handed to a
+        // background thread, so a collection step sweeping big tables and strings doesn't
+        // wait on them. with capacity frees already queued the block is freed inline.
+        // a threshold of 0 stops it once the queued frees are done.
+        struct DeferredFreeStats
+        {
+            uint64_t deferred = 0, inlined = 0; // queued, and freed inline as the queue was full
+            size_t pending = 0;
+        };
+        void setDeferredFree(size_t threshold, size_t capacity = 1024);
+        DeferredFreeStats deferredFreeStats() const;
+
+        // allocation-site memory profiler. wraps the state's allocator and charges sampled
+        // allocations to the Lua source line and function making them, about one every
+        // sampleBytes allocated bytes (0: all of them), each standing for that many bytes.
+        // inside coroutines resumed since the start, the coroutine's line; those already
+        // running then are charged to the line resuming them. from Lua:
+        // tlua.memory.start([sampleBytes]), stop(), report([n]).
+        struct MemorySite
+        {
+            string site; // "source:line in function"
+            int64_t liveBytes = 0, liveCount = 0;
+            int64_t totalBytes = 0, totalCount = 0;
+        };
+        using MemorySnapshot = std::vector<MemorySite>;
+        bool startMemoryProfiler(size_t sampleBytes = 0);
+        void stopMemoryProfiler();
+        // sites sorted by live bytes, estimated from the samples.
+        MemorySnapshot memorySnapshot() const;
+        string memoryReport(int n = 20) const;
+        // the n sites whose live bytes grew most from before to after.
+        static string memoryDiff(const MemorySnapshot& before, const MemorySnapshot& after, int n = 20);
+
+        // writes the object graph reachable from the registry and the main thread to path:
+        // tables, Lua and C functions with their prototypes and upvalues, userdata named
+        // by their tlua type, strings and coroutines, with sizes and labelled edges. weak
+        // references are left out. from Lua: tlua.heap.snapshot(path), diff(before, after
+        // [, n]); tools/tlua_heapdiff does the diff offline.
+        bool heapSnapshot(const char* path);
+        // the n objects whose retained size (the bytes only reachable through them) grew
+        // most between two snapshots, matched by their path from the roots.
+        static string heapDiff(const char* before, const char* after, int n = 20);
+
+        // latency watchdog. LuaRef::call, doFile and doString taking thresholdMs or longer
+        // are logged with the Lua stack and the chain of such calls they run in, and so are
+        // bound C++ calls when TLUA_WATCH_BINDINGS is defined for the whole project. the
+        // stack is taken while the call still runs: a ticker thread arms a one-shot count
+        // hook once the innermost call overruns. a bound call that never returns to Lua in
+        // time is caught when it returns. the last capacity entries are kept. from Lua:
+        // tlua.watchdog.start(ms [, capacity]), stop(), log().
+        struct SlowCall
+        {
+            string call; // "Type.name", "LuaRef::call", "doFile name", "doString ..."
+            string chain; // the watched calls it ran in, outermost first
+            double ms = 0;
+            string stack; // Lua traceback, empty when none could be taken
+        };
+        bool startWatchdog(double thresholdMs, size_t capacity = 64);
+        void stopWatchdog();
+        std::vector<SlowCall> slowCalls() const;
+        string watchdogReport() const;
+
+        // limits on a script call, 0 for none. checked by a count hook every
+        // checkInterval instructions.
+        struct Budget
+        {
+            uint64_t instructions = 0;
+            double ms = 0;
+            int checkInterval = 1000;
+        };
+        // each LuaRef::call, doFile and doString from the host gets this budget, shared
+        // with the calls nested in it and the coroutines they resume. exhausting it raises
+        // a Lua error once, then the budget is spent and the call runs on unchecked.
+        // scripts can't change it. a hook set with debug.sethook keeps running alongside.
+        void setCallBudget(const Budget& budget);
+        const Budget& callBudget() const { return defaultBudget; }
+        // the budget of the host calls made while it lives, in place of the call budget.
+        // in a binding, the calls it makes run on their own budget rather than the one
+        // of the call around them, which gets it back once the scope ends.
+        class BudgetScope;
+        // resumes the coroutine co (a thread, or a function to start one with) with the
+        // budget, yielding it where it is when exhausted. status is LUA_YIELD when it is
+        // to be resumed again, LUA_OK once it returned, or the error, logged. values are
+        // what it yielded or returned.
+        struct ResumeResult
+        {
+            int status = LUA_OK;
+            bool budgetYield = false; // yielded by the budget, not by coroutine.yield
+            std::vector<LuaRef> values;
+        };
+        ResumeResult resume(LuaRef& co, const Budget& budget);
+
+#ifdef TLUA_BINDING_STATS
+        // call statistics of bound C++ functions, most total time first. from Lua:
+        // tlua.bindingStats() returns the same as a list of tables.
+        std::vector<BindingStats> bindingStats() const;
+        void resetBindingStats();
+#endif
+
+#ifdef TLUA_OPCODE_STATS
+        // opcodes executed by the VM, or with pairs consecutive opcode pairs ("GETTABUP
+        // GETTABLE"), most frequent first. define TLUA_OPCODE_STATS for the whole project
+        // to count them. from Lua: tlua.opcodes([reset]) returns both as name -> count tables.
+        using OpcodeCounts = std::vector<std::pair<string, uint64_t>>;
+        OpcodeCounts opcodeStats(bool pairs = false) const;
+        // the n most executed opcodes and pairs with their share of all instructions.
+        string opcodeReport(int n = 20) const;
+        void resetOpcodeStats();
+#endif
+
+        // doString keeps up to capacity compiled chunks in an LRU cache keyed by
+        // the source hash. 0 (the default) disables it.
+        struct ChunkCacheStats { size_t hits, misses, size, capacity; };
+        void setChunkCacheCapacity(size_t capacity);
+        ChunkCacheStats chunkCacheStats() const;
+
+        LuaRef newTable(_TLuaRefSite);
+        LuaRef getGlobal(const char* name _TLuaRefSiteArg);
+
+        // registry refs held by LuaRef/TableProxy, counted always.
+        struct RefStats { size_t live, peak, created; };
+        static RefStats refStats();
+        // live refs grouped by creation site and Lua type, the n largest groups. sites
+        // need TLUA_REF_TRACKING.
+        string dumpRefs(int n = 50) const;
         const char* getCallStack(const char* msg, int ignoreFuncStackCnt = 1);
 
         template<typename T>
         void setGlobal(const char* name, T&& t)
         {
             Stack<T>::push(forward<T>(t));
+            nameFunction(name);
             lua_setglobal(L, name);
         }
 
@@ -401,18 +831,112 @@ namespace tlua
             setGlobal(name, r);
             return r;
         }
+        template<typename T>
+        void newType(const char* name, const TypeReg* regs)
+        {
+            typeNames<T>() = name;
+            registerType(name, [](lua_State* L) -> int { return FuncHelper::invoke(L, &Destruct<T>); }, regs);
+        }
 
 
     private:
+        void registerType(const char* name, lua_CFunction deleter, const TypeReg* regs);
+        static int setupType(lua_State* L);
+        static void setupOverloads(lua_State* L, int cls);
         static string loadFile(const char* name);
+        bool loadCached(const string& path, const char* chunk, size_t size);
+        bool loadPacked(const char* name);
+        bool loadPrecompiled(const char* name);
+        bool loadChunk(const char* source);
+        void saveCached(const string& path, const char* chunk, size_t size);
         static void traceback(const char* msg);
         static int luaLoader(lua_State* L);
+        static void openTLuaLib(lua_State* L);
+        void nameFunction(const char* name);
+        static void hook(lua_State* L, lua_Debug* ar);
+        void updateHook();
+        void updateThreadHook();
+        static void armHook(lua_State* L);
+        static void setThreadHook(lua_State* L);
+        static void releaseThreadHook(lua_State* L);
+        static void newThreadHook(lua_State* L, lua_State* co);
+        static int resumeThread(lua_State* L, lua_State* co, int narg, int* status = nullptr);
+        static void threadHook(lua_State* L, lua_State* from, int event);
 
     private:
         string srcDir;
+        string cacheDir;
+        string callStack;
+        bool dataChunks = false;
+        MappedFile pack;
+        unordered_map<string, pair<string, string>> precompiled; // name -> chunk name, bytecode
+        unordered_set<string> missingModules; // require names with no file under srcDir
+
+        struct CachedChunk
+        {
+            uint64_t hash;
+            string source;
+            LuaRef func;
+        };
+        list<CachedChunk> chunks; // most recently used first
+        unordered_map<uint64_t, list<CachedChunk>::iterator> chunkIndex;
+        size_t chunkCapacity = 0, chunkHits = 0, chunkMisses = 0;
+        unordered_map<const void*, string> funcNames; // bound C++ functions -> Type.name or global name, see cFuncKey
+        struct Profiler;
+        unique_ptr<Profiler> profiler;
+        struct Pool;
+        unique_ptr<Pool> pool;
+        struct MemoryQuota;
+        unique_ptr<MemoryQuota> quota;
+        struct DeferredFree;
+        unique_ptr<DeferredFree> deferredFree;
+        struct MemoryProfiler;
+        unique_ptr<MemoryProfiler> memoryProfiler;
+        // the allocator the quota and deferred frees go on: the state's, or the one
+        // under the memory profiler while it runs.
+        void innerAlloc(lua_Alloc* f, void** ud) const;
+        void setInnerAlloc(lua_Alloc f, void* ud);
+        struct Tracer;
+        unique_ptr<Tracer> trace;
+        friend class WatchedCall;
+        struct Watchdog;
+        unique_ptr<Watchdog> watchdog;
+        // the budget in force: the call budget inside a call, or a resume's.
+        struct BudgetRun
+        {
+            int depth = 0; // nested calls sharing it
+            uint64_t used = 0, limit = 0;
+            int64_t start = 0, deadline = 0; // steady clock ns
+            int interval = 0;
+            lua_State* yieldable = nullptr; // the coroutine resume runs
+            bool yielded = false; // yieldable was yielded for running out
+            bool spent = false; // ran out and raised its error
+        };
+        Budget defaultBudget;
+        BudgetRun budgetRun;
+        void checkBudget(lua_State* L);
+        void updateWatchedCalls();
+        // stops the tools running threads or timers, which fork doesn't carry over. the
+        // function returned starts them again, in the parent and in each child.
+        function<void()> pauseThreads();
+#ifdef TLUA_BINDING_STATS
+        friend class BindingCall;
+        unordered_map<const void*, BindingStats> bindings;
+#endif
         static LuaMgr* instance;
     };
 
+    class LuaMgr::BudgetScope
+    {
+    public:
+        BudgetScope(LuaMgr& mgr, const Budget& budget);
+        ~BudgetScope();
+    private:
+        LuaMgr& mgr;
+        Budget saved;
+        BudgetRun outer;
+    };
+
     //////////////////////////////////////////////////////////////////////////
     /// basic types
 
@@ -628,7 +1152,7 @@ namespace tlua
             lua_pushcclosure(L, [](lua_State* L) {
                 auto& f = *(F*)lua_touserdata(L, lua_upvalueindex(1));
                 if (!f) return 0;
-                return FuncHelper::callCpp<R, A...>(1, f);
+                return FuncHelper::callCpp<R, A...>(L, 1, f);
                 }, 1);
         }
         static F get(int idx)
@@ -697,8 +1221,7 @@ namespace tlua
         {
             lua_pushlightuserdata(L, f);
             lua_pushcclosure(L, [](lua_State* L) {
-                auto f = (F)lua_touserdata(L, lua_upvalueindex(1));
-                return FuncHelper::callCpp<R, A...>(1, f);
+                return Invoker<F>::call(L, (F)lua_touserdata(L, lua_upvalueindex(1)));
                 }, 1);
         }
     };
@@ -712,9 +1235,7 @@ namespace tlua
         {
             new (lua_newuserdata(L, sizeof(T))) T(move(f));
             lua_pushcclosure(L, [](lua_State* L) {
-                auto& f = *(T*)lua_touserdata(L, lua_upvalueindex(1));
-                using FT = function_traits<T>;
-                return FuncHelper::callCpp<typename FT::return_type>((typename FT::argument_tuple*)nullptr, 1, f);
+                return Invoker<T>::call(L, *(T*)lua_touserdata(L, lua_upvalueindex(1)));
                 }, 1);
         }
     };
@@ -727,12 +1248,7 @@ namespace tlua
         {
             *(MF*)lua_newuserdata(L, sizeof(MF)) = f;
             lua_pushcclosure(L, [](lua_State* L) {
-                return FuncHelper::callCpp<R, A...>(2, [L](A&&... a) {
-                    auto f = *(MF*)lua_touserdata(L, lua_upvalueindex(1));
-                    auto obj = Stack<C*>::get(1);
-                    if (!obj) throw std::runtime_error("self is nil");
-                    return (obj->*f)(forward<A>(a)...);
-                    });
+                return Invoker<R(C::*)(A...)>::call(L, *(MF*)lua_touserdata(L, lua_upvalueindex(1)));
                 }, 1);
         }
     };
@@ -744,4 +1260,49 @@ namespace tlua
     template< typename R, typename C, typename... A>
     struct Stack<R(C::*)(A...)const noexcept> : Stack<R(C::*)(A...)const>
     {};
+
+    //////////////////////////////////////////////////////////////////////////
+    // call a C++ callable with arguments from the lua stack
+
+    // lambda
+    template<typename F>
+    struct Invoker
+    {
+        static int call(lua_State* caller, F& f)
+        {
+            using FT = function_traits<F>;
+            return FuncHelper::callCpp<typename FT::return_type>(caller, (typename FT::argument_tuple*)nullptr, 1, f);
+        }
+    };
+
+    template<typename R, typename... A>
+    struct Invoker<R(*)(A...)>
+    {
+        static int call(lua_State* caller, R(*f)(A...))
+        {
+            return FuncHelper::callCpp<R, A...>(caller, 1, f);
+        }
+    };
+
+    template< typename R, typename C, typename... A>
+    struct Invoker<R(C::*)(A...)>
+    {
+        template<typename MF>
+        static int call(lua_State* caller, MF f)
+        {
+            return FuncHelper::callCpp<R, A...>(caller, 2, [f](A&&... a) {
+                auto obj = Stack<C*>::get(1);
+                if (!obj) throw std::runtime_error("self is nil");
+                return (obj->*f)(forward<A>(a)...);
+                });
+        }
+    };
+
+    template< typename R, typename C, typename... A>
+    struct Invoker<R(C::*)(A...)const> : Invoker<R(C::*)(A...)>
+    {};
+
+    template< typename R, typename C, typename... A>
+    struct Invoker<R(C::*)(A...)const noexcept> : Invoker<R(C::*)(A...)const>
+    {};
 }
@@ -0,0 +1,185 @@
+// Data chunk loader check, see LuaMgr::setDataChunkLoader.
+// usage: tlua_datacheck [file...]
+//   loads each file as a module with the data chunk loader and with the compiler, and
+//   compares the tables. without files, a built-in set of tricky chunks is checked.
+//   exits 1 when any differ.
+//
+#include "../tlua.h"
+#include <stdio.h>
+#include <string.h>
+#include <fstream>
+#include <sstream>
+
+using std::string;
+
+struct Case
+{
+    string name, text;
+};
+
+static string nested(int depth)
+{
+    return "return " + string(depth, '{') + string(depth, '}');
+}
+
+static string large(int n)
+{
+    string s = "return {\n";
+    for (int i = 0; i < n; i++) {
+        char line[128];
+        snprintf(line, sizeof(line), "  %d, k%d = 'v%d', [%d.5] = %g, { %d, \"x\\%d\" },\n", i, i, i, i, i * 0.25, -i, i % 256);
+        s += line;
+    }
+    return s + "}\n";
+}
+
+static std::vector<Case> corpus()
+{
+    return {
+        { "integers", "return { 0, 1, -1, 0x10, 0xff, 0XfF, 9223372036854775807, -9223372036854775808,"
+                      " 0x7fffffffffffffff, 0xffffffffffffffff, 0x10000000000000000, 9223372036854775808, - 5 }" },
+        { "floats", "return { 1.5, -0.0, 0.0, 1e10, 1E-3, .5, 5., 0x1p4, 0x.8, 0xA.8p1, 3e308, 1e400, -1e400, 1e+2, 2.e-1 }" },
+        { "escapes", R"~(return { "a\tb\nc\r\v\f\a\b", 'q\'q', "\\", "\65\066\0677", "\x41\x4a\x4A", "\u{48}\u{7FF}\u{FFFF}\u{10FFFF}",
+            "a\z
+               b", "line\
+next", "\"", '"', "\0", "\255" })~" },
+        { "bad escapes", R"~(return { "\q" })~" },
+        { "long strings", "return { [[plain]], [==[with ]] inside]==], [[\nfirst newline skipped]], [=[\r\n]=], [[a\nb]], [[\\n]], [[]] }" },
+        { "unfinished long string", "return { [==[ never closed ]=] }" },
+        { "duplicate keys", "return { a = 1, a = 2, [1] = 'x', 'y', [2] = 'z', ['b'] = 1, b = 2, [3.0] = 'three', 'w' }" },
+        { "nil and booleans", "return { 1, nil, 3, nil, k = nil, t = true, f = false, [true] = 1, [false] = 0 }" },
+        { "separators", "return { 1; 2, 3; x = 1; }" },
+        { "empty", "return {}" },
+        { "nesting 50", nested(50) },
+        { "nesting 190", nested(190) },
+        { "nesting 250", nested(250) },
+        { "comments", R"~(-- leading
+return { -- line
+  1, --[[ block ]] 2, --[==[ long
+  ]==] x = --[[c]] 3, ["--"] = "--[[not a comment]]",
+  y --[[ between ]] = 4 } -- trailing)~" },
+        { "comment before key", "return {\n  a --\n  = 1,\n}\n" },
+        { "keys", R"~(return { ["end"] = 1, nil_ = 2, _ = 3, ["a\0b"] = 4, ["\u{E9}"] = 5, [-1] = 6, [0] = 7, [1e300] = 8 })~" },
+        { "nested", "return { a = { b = { c = { 1, 2, { d = 'e' } } } }, { { {} } } }" },
+        { "table key", "return { [{}] = 1 }" },
+        { "not data", "return { f = function() end, x = 1 + 1, y = #'abc', z = -'2', w = 2^53 }" },
+        { "globals", "return { os = os ~= nil, math.pi }" },
+        { "trailing code", "return { 1 } x = 1" },
+        { "trailing semicolon", "return { 1 };\n-- end" },
+        { "shebang", "#!/usr/bin/lua\nreturn { 1 }" },
+        { "no return", "{ 1 }" },
+        { "return two", "return { 1 }, { 2 }" },
+        { "paren", "return ({ 1 })" },
+        { "unbalanced", "return { 1, { 2 }" },
+        { "large", large(5000) },
+    };
+}
+
+// the module the searcher found for the chunk and what it returned: 1 when the data
+// chunk loader built it, 0 when it was compiled, -1 on error.
+static int load(tlua::LuaMgr& lua, bool dataChunks)
+{
+    static const char* require =
+        "for _, search in ipairs(package.searchers) do "
+        "  local loader = search('datacheck') "
+        "  if type(loader) == 'function' then return debug.getinfo(loader, 'S').what == 'C', loader('datacheck') end "
+        "end "
+        "error('not found')";
+    auto L = tlua::LuaObj::L;
+    lua.setDataChunkLoader(dataChunks);
+    lua.clearResolveCache();
+    if (luaL_loadstring(L, require) != LUA_OK || lua_pcall(L, 0, 2, 0) != LUA_OK) return -1;
+    auto built = lua_toboolean(L, -2);
+    lua_remove(L, -2);
+    return built;
+}
+
+// the values at a and b are the same, tables by content, floats to the bit.
+static bool same(lua_State* L, int a, int b, string& where)
+{
+    a = lua_absindex(L, a);
+    b = lua_absindex(L, b);
+    if (lua_type(L, a) != lua_type(L, b) || lua_isinteger(L, a) != lua_isinteger(L, b)) return false;
+    if (lua_type(L, a) == LUA_TNUMBER && !lua_isinteger(L, a)) {
+        auto x = lua_tonumber(L, a), y = lua_tonumber(L, b);
+        return memcmp(&x, &y, sizeof(x)) == 0;
+    }
+    // two loads make two closures, only their type is compared.
+    if (lua_isfunction(L, a)) return true;
+    if (!lua_istable(L, a)) return lua_rawequal(L, a, b) != 0;
+    luaL_checkstack(L, 4, "tables nested too deep");
+    int n = 0;
+    lua_pushnil(L);
+    while (lua_next(L, a)) {
+        n++;
+        // a table key is a new table each way, only counted.
+        if (lua_istable(L, -2)) {
+            lua_pop(L, 1);
+            continue;
+        }
+        lua_pushvalue(L, -2);
+        lua_rawget(L, b);
+        if (!same(L, -2, -1, where)) {
+            lua_pushvalue(L, -3);
+            where = string("[") + luaL_tolstring(L, -1, nullptr) + "]" + where;
+            lua_pop(L, 4);
+            return false;
+        }
+        lua_pop(L, 2);
+    }
+    lua_pushnil(L);
+    while (lua_next(L, b)) {
+        n--;
+        lua_pop(L, 1);
+    }
+    return n == 0;
+}
+
+static bool check(tlua::LuaMgr& lua, const Case& c, string& text)
+{
+    auto L = tlua::LuaObj::L;
+    auto top = lua_gettop(L);
+    text = c.text;
+    auto built = load(lua, true);
+    auto compiled = load(lua, false);
+    string where;
+    auto ok = built < 0 ? compiled < 0 : compiled >= 0 && same(L, -2, -1, where);
+    if (!ok) {
+        printf("DIFF %s: loader %s, compiler %s", c.name.c_str(), built < 0 ? "failed" : "loaded", compiled < 0 ? "failed" : "loaded");
+        if (!where.empty()) printf(", first at %s", where.c_str());
+        printf("\n");
+    }
+    else {
+        printf("ok   %s (%s)\n", c.name.c_str(), built > 0 ? "built" : built == 0 ? "compiled" : "rejected by both");
+    }
+    lua_settop(L, top);
+    return ok;
+}
+
+int main(int argc, char** argv)
+{
+    std::vector<Case> cases;
+    for (int i = 1; i < argc; i++) {
+        std::ifstream in(argv[i], std::ios::binary);
+        if (!in) {
+            fprintf(stderr, "can not read %s\n", argv[i]);
+            return 2;
+        }
+        std::stringstream text;
+        text << in.rdbuf();
+        cases.push_back({ argv[i], text.str() });
+    }
+    if (cases.empty()) cases = corpus();
+
+    tlua::LuaMgr lua;
+    string text;
+    lua.logError = [](const char*) {};
+    lua.fileLoader = [&text](const char*) { return text; };
+    lua.setLoaderPriority(1);
+    auto failed = 0;
+    for (auto& c : cases) {
+        if (!check(lua, c, text)) failed++;
+    }
+    printf("%d of %zu differ\n", failed, cases.size());
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,19 @@
+// Heap snapshot diff, see LuaMgr::heapSnapshot and LuaMgr::heapDiff.
+// usage: tlua_heapdiff <before> <after> [n]
+//   n    objects to list, most retained-size growth first (default 20)
+//
+#include "../tlua.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(int argc, char** argv)
+{
+    if (argc != 3 && argc != 4) {
+        fprintf(stderr, "usage: %s <before> <after> [n]\n", argv[0]);
+        return 2;
+    }
+
+    auto report = tlua::LuaMgr::heapDiff(argv[1], argv[2], argc == 4 ? atoi(argv[3]) : 20);
+    fputs(report.c_str(), stdout);
+    return report.compare(0, 4, "not ") == 0 ? 1 : 0;
+}
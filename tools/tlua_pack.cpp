@@ -0,0 +1,23 @@
+// Module pack builder, see LuaMgr::buildPack and LuaMgr::mountPack.
+// usage: tlua_pack [-s] <srcRoot> <packFile>
+//   -s   store sources instead of bytecode
+//
+#include "../tlua.h"
+#include <stdio.h>
+
+int main(int argc, char** argv)
+{
+    auto compile = true;
+    auto arg = 1;
+    if (argc > 1 && strcmp(argv[1], "-s") == 0) {
+        compile = false;
+        arg++;
+    }
+    if (argc - arg != 2) {
+        fprintf(stderr, "usage: %s [-s] <srcRoot> <packFile>\n", argv[0]);
+        return 2;
+    }
+
+    tlua::LuaMgr lua;
+    return lua.buildPack(argv[arg], argv[arg + 1], compile) ? 0 : 1;
+}